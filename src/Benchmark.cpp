@@ -0,0 +1,247 @@
+/**
+* @file Benchmark.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of benchmark class.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+
+#include "Benchmark.hpp"
+#include "Fractal.hpp"
+#include "utils/Timer.hpp"
+#include "utils/Profiler.hpp"
+#include "utils/Json.hpp"
+
+const unsigned int cBenchmarkSeed = 1234; /**< Seed of fractal colors, same for every run */
+const float cPi = 3.14159265f;
+const int cZoneFrame = Profiler::getInstance().registerZone("frame", true);
+
+//Benchmark constructor
+Benchmark::Benchmark(Engine& engine, const BenchmarkConfig_t& config)
+  : _engine(engine), _config(config)
+{
+  _level = 0;
+  _implicit = false;
+  _memoryBudget = 0;
+  _drawnFaces = _hiddenFaces = 0;
+  _submitted = _drawn = _culled = 0.0;
+}
+
+//Benchmark destructor
+Benchmark::~Benchmark()
+{
+}
+
+//Run camera path
+void Benchmark::run(int board)
+{
+  _frameTimes.assign(_config.frames, 0);
+  _stageTimes.assign(_config.frames, FrameTimes_t());
+  _drawnFaces = _hiddenFaces = 0;
+  _submitted = _drawn = _culled = 0.0;
+
+  //Fractal colors come from rand
+  srand(cBenchmarkSeed);
+
+  Fractal* fractal;
+  FractalCube* cube = 0;
+  if(_config.figure == Engine::BUTTON_PYRAMID) {
+    fractal = new FractalPyramid;
+  } else {
+    cube = new FractalCube;
+    cube->setImplicit(_config.implicit);
+    cube->setLodThreshold(_config.lod);
+    fractal = cube;
+  }
+  //Levels are estimated with pipeline depth of engine
+  fractal->setRenderer(_engine);
+  if(_config.memory > 0)
+    fractal->setMemoryBudget(static_cast<Uint64>(_config.memory) * 1024 * 1024);
+
+  while(fractal->getLevel() < _config.level) {
+    int level = fractal->getLevel();
+    fractal->addLevel();
+    if(fractal->getLevel() == level)
+      break;
+  }
+  _level = fractal->getLevel();
+  _implicit = cube && cube->isImplicit();
+  _refusal = fractal->getRefusal();
+  _memoryBudget = fractal->getMemoryBudget();
+
+  _engine.setState(Engine::GAME_STATE);
+  _engine.setFramePacing(Engine::PACING_UNCAPPED);
+  _engine.setRenderMode(_config.renderMode);
+
+  //Frame submitted in loop i is shown lag loops later, stage times and
+  //counters are taken when frame is shown so they belong to the same frame
+  //as wall time of loop it was submitted in. Last frames are drawn by
+  //extra loops that are not measured
+  int lag = _engine.getPipelineDepth() - 1;
+  int total = _config.warmup + _config.frames;
+  for(int i = 0; i < total + lag; i++) {
+    //Keep window responsive, input is ignored
+    SDL_PumpEvents();
+
+    if(i == _config.warmup)
+      Profiler::getInstance().clear();
+
+    ProfileZone frameZone(cZoneFrame);
+    Uint64 start = getTimeNs();
+
+    _engine.clearScreen();
+    _engine.clearZbuffer();
+    setCamera(i, total);
+
+    if(board >= 0)
+      _engine.drawMesh(board);
+    fractal->render(_engine);
+
+    _engine.updateScreen();
+
+    Uint64 frame = getTimeNs() - start;
+
+    if((i >= _config.warmup) && (i < total))
+      _frameTimes[i - _config.warmup] = frame;
+
+    int shown = i - lag;
+    if(shown < _config.warmup)
+      continue;
+
+    _stageTimes[shown - _config.warmup] = _engine.getFrameTimes();
+
+    const RenderStats_t& stats = _engine.getRenderStats();
+    _submitted += stats.submitted;
+    _drawn += stats.drawn;
+    _culled += stats.backFacing + stats.outsideFrustum;
+  }
+
+  if(cube) {
+    _drawnFaces = cube->getDrawnFaces();
+    _hiddenFaces = cube->getHiddenFaces();
+  }
+
+  delete fractal;
+}
+
+//Orbit around fractal while moving closer and back
+void Benchmark::setCamera(int frame, int frames)
+{
+  float t = static_cast<float>(frame) / frames;
+
+  float ax = 15.0f + 10.0f * sinf(2.0f * cPi * t);
+  float ay = 360.0f * t;
+  float az = 0.0f;
+  float z = -300.0f * (0.5f - 0.5f * cosf(2.0f * cPi * t)) - _config.zoom;
+
+  _engine.loadIdentity();
+  _engine.translate(0.0f, 0.0f, z);
+  _engine.rotate(ax, 1, 0, 0);
+  _engine.rotate(ay, 0, 1, 0);
+  _engine.rotate(az, 0, 0, 1);
+}
+
+//Write results
+void Benchmark::writeJson(std::ostream& out) const
+{
+  int n = _frameTimes.size();
+
+  std::vector<Uint64> transform(n), setup(n), bin(n), raster(n), present(n), other(n);
+  Uint64 total = 0;
+  for(int i = 0; i < n; i++) {
+    const FrameTimes_t& t = _stageTimes[i];
+    transform[i] = t.transform;
+    setup[i] = t.setup;
+    bin[i] = t.bin;
+    raster[i] = t.raster;
+    present[i] = t.present;
+
+    //Clearing, scene traversal and anything else outside of engine stages
+    Uint64 stages = t.transform + t.setup + t.bin + t.raster + t.present + t.pacing;
+    other[i] = (_frameTimes[i] > stages) ? _frameTimes[i] - stages : 0;
+    total += _frameTimes[i];
+  }
+
+  double count = (n > 0) ? n : 1;
+
+  out << std::fixed << std::setprecision(4);
+  out << "{\n";
+  out << "  \"benchmark\": \"camera_path\",\n";
+  out << "  \"figure\": \"" << ((_config.figure == Engine::BUTTON_PYRAMID) ? "pyramid" : "cube") << "\",\n";
+  out << "  \"level\": " << _level << ",\n";
+  out << "  \"frames\": " << n << ",\n";
+  out << "  \"warmup\": " << _config.warmup << ",\n";
+  out << "  \"width\": " << _config.width << ",\n";
+  out << "  \"height\": " << _config.height << ",\n";
+  out << "  \"bpp\": " << _config.bpp << ",\n";
+  out << "  \"headless\": " << (_config.headless ? "true" : "false") << ",\n";
+  out << "  \"implicit\": " << (_implicit ? "true" : "false") << ",\n";
+  out << "  \"memory_budget_mb\": " << (_memoryBudget / (1024 * 1024)) << ",\n";
+  out << "  \"level_refused\": ";
+  writeJsonString(out, _refusal);
+  out << ",\n";
+  out << "  \"lod_threshold\": " << _config.lod << ",\n";
+  out << "  \"zoom\": " << _config.zoom << ",\n";
+  out << "  \"render_mode\": \"" << ((_config.renderMode == Engine::RENDER_FILLED) ? "filled" : "lines") << "\",\n";
+  out << "  \"rasterizer\": \"" << ((_engine.getRasterizer() == Engine::RASTER_HALFSPACE) ? "halfspace" : "scanline") << "\",\n";
+  out << "  \"raster_threads\": " << _engine.getRasterThreads() << ",\n";
+  out << "  \"pipeline_depth\": " << _engine.getPipelineDepth() << ",\n";
+  if(_config.figure != Engine::BUTTON_PYRAMID) {
+    out << "  \"faces_drawn\": " << _drawnFaces << ",\n";
+    out << "  \"faces_hidden\": " << _hiddenFaces << ",\n";
+  }
+  out << "  \"triangles_submitted_avg\": " << _submitted / count << ",\n";
+  out << "  \"triangles_drawn_avg\": " << _drawn / count << ",\n";
+  out << "  \"triangles_culled_avg\": " << _culled / count << ",\n";
+  out << "  \"fps_avg\": " << ((total > 0) ? n / (nsToMs(total) / 1000.0) : 0.0) << ",\n";
+  out << "  \"stages_ms\": {\n";
+  writeStage(out, "frame", _frameTimes);
+  out << ",\n";
+  writeStage(out, "transform", transform);
+  out << ",\n";
+  writeStage(out, "setup", setup);
+  out << ",\n";
+  writeStage(out, "bin", bin);
+  out << ",\n";
+  writeStage(out, "raster", raster);
+  out << ",\n";
+  writeStage(out, "present", present);
+  out << ",\n";
+  writeStage(out, "other", other);
+  out << "\n  }\n";
+  out << "}\n";
+}
+
+/**
+* Nearest rank percentile of sorted times
+*/
+static Uint64 percentile(const std::vector<Uint64>& sorted, int p)
+{
+  if(sorted.empty())
+    return 0;
+
+  int rank = (p * static_cast<int>(sorted.size()) + 99) / 100;
+  return sorted[std::max(rank, 1) - 1];
+}
+
+//Write one stage
+void Benchmark::writeStage(std::ostream& out, const char* name, std::vector<Uint64> times) const
+{
+  std::sort(times.begin(), times.end());
+
+  Uint64 sum = 0;
+  for(unsigned int i = 0; i < times.size(); i++)
+    sum += times[i];
+  double mean = times.empty() ? 0.0 : nsToMs(sum) / times.size();
+
+  out << "    \"" << name << "\": {"
+      << "\"mean\": " << mean
+      << ", \"p50\": " << nsToMs(percentile(times, 50))
+      << ", \"p95\": " << nsToMs(percentile(times, 95))
+      << ", \"p99\": " << nsToMs(percentile(times, 99))
+      << ", \"max\": " << nsToMs(times.empty() ? 0 : times.back())
+      << "}";
+}
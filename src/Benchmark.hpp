@@ -0,0 +1,91 @@
+/**
+* @file Benchmark.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of benchmark class.
+* Benchmark draws fractal along fixed camera path as fast as it can and
+* reports frame time percentiles of every engine stage.
+*/
+
+#ifndef BENCHMARK_HPP_INCLUDED
+#define BENCHMARK_HPP_INCLUDED
+
+#include <vector>
+#include <string>
+#include <ostream>
+
+#include "api/Engine.hpp"
+
+//Benchmark settings
+typedef struct{
+  int figure; //Engine::BUTTON_CUBE or Engine::BUTTON_PYRAMID
+  int level; //Fractal level
+  int frames; //Number of measured frames
+  int warmup; //Frames drawn before measuring
+  int renderMode; //Engine render mode
+  int width, height, bpp; //Screen the engine was created with
+  bool headless; //Engine renders without window
+  bool implicit; //Cube is rendered implicitly, without stored sub cubes
+  float lod; //Cube level of detail threshold in pixels, 0 for none
+  float zoom; //Camera is moved this much closer than on camera path
+  int memory; //Fractal memory budget in megabytes, 0 for default
+}BenchmarkConfig_t;
+
+class Benchmark{
+  public:
+    /**
+    * Ctor
+    * @param engine Engine to draw with.
+    * @param config Benchmark settings.
+    */
+    Benchmark(Engine& engine, const BenchmarkConfig_t& config);
+
+    /**
+    * Dtor
+    */
+    ~Benchmark();
+
+    /**
+    * Run camera path, results of previous run are dropped
+    * @param board Board mesh drawn under fractal, -1 for none.
+    */
+    void run(int board);
+
+    /**
+    * Write results of last run as JSON
+    * @param out Stream to write into.
+    */
+    void writeJson(std::ostream& out) const;
+
+  private:
+    /**
+    * Set camera of frame, same calls as main loop makes
+    * @param frame Frame index on the path.
+    * @param frames Length of the path.
+    */
+    void setCamera(int frame, int frames);
+
+    /**
+    * Write percentiles of one stage
+    * @param out Stream to write into.
+    * @param name Stage name.
+    * @param times Stage time of every frame in nanoseconds.
+    */
+    void writeStage(std::ostream& out, const char* name, std::vector<Uint64> times) const;
+
+    Engine& _engine; /**< Engine to draw with */
+    BenchmarkConfig_t _config; /**< Settings */
+    int _level; /**< Level fractal really reached */
+    bool _implicit; /**< Cube was rendered implicitly */
+    std::string _refusal; /**< Why next level was not added */
+    Uint64 _memoryBudget; /**< Memory budget of fractal */
+
+    std::vector<Uint64> _frameTimes; /**< Whole frame times */
+    std::vector<FrameTimes_t> _stageTimes; /**< Engine stage times */
+    int _drawnFaces; /**< Faces of cube drawn, hidden ones left out */
+    int _hiddenFaces; /**< Faces of cube left out as covered */
+    double _submitted; /**< Sum of submitted triangles */
+    double _drawn; /**< Sum of drawn triangles */
+    double _culled; /**< Sum of culled triangles */
+};
+
+#endif // BENCHMARK_HPP_INCLUDED
@@ -4,55 +4,331 @@
 * @brief Realization of fractal class.
 */
 
+#include <algorithm>
+#include <sstream>
+
 #include "Fractal.hpp"
+#include "utils/Profiler.hpp"
+#include "utils/Memory.hpp"
+
+//Profiling zones
+const int cZoneCubeLevel = Profiler::getInstance().registerZone("FractalCube::addLevel", true);
+const int cZonePyramidLevel = Profiler::getInstance().registerZone("FractalPyramid::addLevel", true);
+
+//Parents analyzed by one job of level pool
+const int cLevelChunk = 64;
+
+//Lattice step to neighbour behind every cube face, yi grows downward
+const int cNeighbour[6][3] = {{0, 0, -1}, {0, 0, 1}, {0, -1, 0}, {0, 1, 0}, {-1, 0, 0}, {1, 0, 0}};
+
+//Instances chosen at draw time submitted at once
+const int cInstanceBatch = 256;
+
+//Cube parts, one for every combination of visible faces
+const int cCubeParts = 64;
+const int cAllFaces = cCubeParts - 1;
+
+//Radius of sphere around cube of size 1 is sqrt(3) / 2
+const float cSqrt3 = 1.7320508f;
+
+//Memory budget if physical memory is not known
+const Uint64 cDefaultMemoryBudget = 1024 * 1024 * 1024;
+
+//Level being built by cube pool
+typedef struct{
+  FractalCube* fractal;
+  const FractalCube_t* parents;
+  FractalCube_t* children;
+  int count;
+}CubeLevel_t;
+
+//Level being built by pyramid pool
+typedef struct{
+  FractalPyramid* fractal;
+  const FractalPyramid_t* parents;
+  FractalPyramid_t* children;
+  int count;
+}PyramidLevel_t;
+
+//Number of chunks parents are split to
+static int levelChunks(int parents)
+{
+  return (parents + cLevelChunk - 1) / cLevelChunk;
+}
+
+//Number of faces set in visible faces mask
+static int countFaces(int visible)
+{
+  int faces = 0;
+  for(int i = 0; i < 6; i++) {
+    if(visible & (1 << i))
+      faces++;
+  }
+  return faces;
+}
+
+//Bytes in megabytes, for messages
+static std::string megabytes(double bytes)
+{
+  std::ostringstream out;
+  out << static_cast<Uint64>(bytes / (1024.0 * 1024.0)) << " MB";
+  return out.str();
+}
+
+//Move point to space with given origin and unit size
+static void toLocal(Point3_t& point, const Point3_t& origin, float size)
+{
+  point.x = (point.x - origin.x) / size;
+  point.y = (point.y - origin.y) / size;
+  point.z = (point.z - origin.z) / size;
+}
 
 /**
-* Copy lists, copy one list to antoher
+* Push vertex, add point with color to vertex list
 */
-void copyList(FractalList& from, FractalList& to)
+void pushVertex(Vertex2List& vertices, const Point3_t& point, const Color4_t& color)
 {
-  FractalListIter iter;
-  to.clear();
-  for(iter = from.begin(); iter != from.end(); ++iter)
-    to.push_back(*iter);
+  Vertex2_t v;
+  v.point = point;
+  v.color = color;
+  v.color.a = 1.0f; //Faces carry no alpha, draw them opaque
+  vertices.push_back(v);
 }
 
 /**
-* Copy pyramid lists, copy one list to antoher
+* Check if normal (b - a) x (c - a) points away from inside point
 */
-void copyPyrList(FractalPyrList& from, FractalPyrList& to)
+bool facesOutward(const Point3_t& a, const Point3_t& b, const Point3_t& c, const Point3_t& inside)
 {
-  FractalPyrListIter iter;
-  to.clear();
-  for(iter = from.begin(); iter != from.end(); ++iter)
-    to.push_back(*iter);
+  float x1 = b.x - a.x, y1 = b.y - a.y, z1 = b.z - a.z;
+  float x2 = c.x - a.x, y2 = c.y - a.y, z2 = c.z - a.z;
+
+  float nx = y1 * z2 - z1 * y2;
+  float ny = z1 * x2 - x1 * z2;
+  float nz = x1 * y2 - y1 * x2;
+
+  return (nx * (a.x - inside.x) + ny * (a.y - inside.y) + nz * (a.z - inside.z)) > 0.0f;
+}
+
+/**
+* Push triangle wound outward, so it can be back face culled
+*/
+void pushTriangle(Vertex2List& vertices, const Point3_t& a, const Point3_t& b, const Point3_t& c,
+                  const Point3_t& inside, const Color4_t& color)
+{
+  pushVertex(vertices, a, color);
+  if(facesOutward(a, b, c, inside)) {
+    pushVertex(vertices, b, color);
+    pushVertex(vertices, c, color);
+  } else {
+    pushVertex(vertices, c, color);
+    pushVertex(vertices, b, color);
+  }
+}
+
+//Fractal constructor, half of physical memory is left for the rest
+Fractal::Fractal()
+{
+  _renderer = 0;
+  _pool = 0;
+  _dirty = true;
+  _memoryBudget = getPhysicalMemory() / 2;
+  if(!_memoryBudget)
+    _memoryBudget = cDefaultMemoryBudget;
+}
+
+//Fractal destructor
+Fractal::~Fractal()
+{
+  destroyMeshes();
+  if(_pool)
+    delete _pool;
+}
+
+//Set renderer, meshes belong to renderer so they are made again
+void Fractal::setRenderer(Engine& renderer)
+{
+  if(_renderer != &renderer) {
+    destroyMeshes();
+    _renderer = &renderer;
+    _dirty = true;
+  }
+}
+
+//Render fractal, rebuild parts only when fractal changed
+void Fractal::render(Engine& renderer)
+{
+  setRenderer(renderer);
+
+  if(_dirty) {
+    FractalPartList parts;
+    buildParts(parts);
+
+    while(_meshes.size() > parts.size()) {
+      renderer.destroyMesh(_meshes.back());
+      _meshes.pop_back();
+    }
+    while(_meshes.size() < parts.size()) {
+      int mesh = renderer.createMesh();
+      //Fractals are closed and their faces are wound outward
+      renderer.setMeshCulling(mesh, true);
+      _meshes.push_back(mesh);
+    }
+
+    _instances.resize(parts.size());
+    for(unsigned int i = 0; i < parts.size(); i++) {
+      const Vertex2List& vertices = parts[i].vertices;
+      if(vertices.empty())
+        renderer.setMeshVertices(_meshes[i], 0, 0, parts[i].triangleMode);
+      else
+        renderer.setMeshVertices(_meshes[i], &vertices[0], vertices.size(), parts[i].triangleMode);
+      _instances[i].swap(parts[i].instances);
+    }
+    _dirty = false;
+  }
+
+  for(unsigned int i = 0; i < _instances.size(); i++) {
+    if(!_instances[i].empty())
+      drawPart(renderer, i, &_instances[i][0], _instances[i].size());
+  }
+
+  renderInstances(renderer);
+}
+
+//Fractals store all their instances by default
+void Fractal::renderInstances(Engine&)
+{
+}
+
+//Draw part instances
+void Fractal::drawPart(Engine& renderer, int part, const Instance_t* instances, int count)
+{
+  renderer.drawInstanced(_meshes[part], instances, count);
+}
+
+//Destroy meshes
+void Fractal::destroyMeshes()
+{
+  if(_renderer) {
+    for(unsigned int i = 0; i < _meshes.size(); i++)
+      _renderer->destroyMesh(_meshes[i]);
+  }
+  _meshes.clear();
+  _instances.clear();
+}
+
+//Invalidate mesh
+void Fractal::invalidate()
+{
+  _dirty = true;
+}
+
+//Get level pool, own one as renderer pool may be busy drawing
+ThreadPool& Fractal::getPool()
+{
+  if(!_pool)
+    _pool = new ThreadPool(getNumProcessors());
+  return *_pool;
+}
+
+//Set memory budget
+void Fractal::setMemoryBudget(Uint64 bytes)
+{
+  _memoryBudget = bytes;
+}
+
+//Get memory budget
+Uint64 Fractal::getMemoryBudget() const
+{
+  return _memoryBudget;
+}
+
+//Get refusal
+const std::string& Fractal::getRefusal() const
+{
+  return _refusal;
+}
+
+//Take messages
+std::string Fractal::takeNotice()
+{
+  std::string text;
+  text.swap(_notice);
+  return text;
+}
+
+//Add message
+void Fractal::notice(const std::string& text)
+{
+  if(!_notice.empty())
+    _notice += '\n';
+  _notice += text;
+}
+
+//Check level against budget, refused level is noticed
+bool Fractal::fitsBudget(int level, double bytes)
+{
+  _refusal.clear();
+  if(bytes <= static_cast<double>(_memoryBudget))
+    return true;
+
+  std::ostringstream out;
+  out << "Level " << level << " needs about " << megabytes(bytes)
+      << ", memory budget is " << megabytes(static_cast<double>(_memoryBudget));
+  _refusal = out.str();
+  notice(_refusal);
+  return false;
+}
+
+//Every frame in flight keeps its transformed vertices and one more stream
+//is being submitted, projected triangles are kept once. Stored instances
+//and batches waiting for drawing come on top
+double Fractal::frameBytes(double vertices, double triangles, int parts) const
+{
+  int frames = _renderer ? _renderer->getPipelineDepth() : 1;
+
+  double instances = static_cast<double>(parts) * cInstanceBatch;
+  for(unsigned int i = 0; i < _instances.size(); i++)
+    instances += _instances[i].size();
+
+  return (frames + 1) * vertices * sizeof(Vertex2_t) + triangles * sizeof(Triangle2_t) +
+         instances * sizeof(Instance_t);
 }
 
 //Fractal cube constructor
 FractalCube::FractalCube()
 {
-  _fractalCubesList.clear();
-
   size = 180.0f;
   _level = 1;
   _inverse = false;
+  _implicit = false;
+  _lodThreshold = 0.0f;
+  _drawnFaces = _hiddenFaces = 0;
   makeBaseFractal();
+  resetCounts();
 }
 
 //Faractal cube destructor
 FractalCube::~FractalCube()
 {
-  _fractalCubesList.clear();
+  _levels.clear();
 }
 
-//Render cube
-void FractalCube::render(Engine& renderer)
+//Build cube parts, unit cube with every combination of visible faces,
+//cubes are chosen every frame by renderInstances
+void FractalCube::buildParts(FractalPartList& parts)
 {
-  renderer.setTriangleMode(Engine::TRIANGLE_STRIP);
-  FractalListIter iter;
-
-  for(iter = _fractalCubesList.begin(); iter != _fractalCubesList.end(); ++iter)
-    drawCube(renderer, *iter);
+  //Cube faces are drawn as strips
+  parts.resize(cCubeParts);
+  for(int visible = 0; visible < cCubeParts; visible++) {
+    parts[visible].triangleMode = Engine::TRIANGLE_STRIP;
+    if(!visible)
+      continue;
+
+    FractalCube_t cube;
+    makeUnitCube(cube, visible);
+    drawCube(parts[visible].vertices, cube);
+  }
 }
 
 //Handle input
@@ -61,34 +337,291 @@ void FractalCube::handleInput(SDL_Event& event)
   if(event.type == SDL_KEYDOWN) {
     if(event.key.keysym.sym == SDLK_SPACE)
       addLevel();
+    if(event.key.keysym.sym == SDLK_i)
+      setImplicit(!_implicit);
   }
 }
 
-//Add level
-void FractalCube::addLevel()
+//Get level
+int FractalCube::getLevel() const
+{
+  return _level;
+}
+
+//Switch implicit rendering
+void FractalCube::setImplicit(bool implicit)
 {
-  if(!_inverse) {
-    if(_level > 3)
+  if(implicit == _implicit)
+    return;
+
+  _implicit = implicit;
+  invalidate();
+
+  //Implicit sponge keeps only base cube, stored levels are rebuilt from it
+  _levels.resize(1);
+  if(_implicit)
+    return;
+
+  int level = _level;
+  _level = 1;
+  resetCounts();
+  while(_level < level) {
+    int current = _level;
+    addLevel();
+    if(_level == current)
+      break;
+  }
+}
+
+//Is implicit
+bool FractalCube::isImplicit() const
+{
+  return _implicit;
+}
+
+//Set level of detail
+void FractalCube::setLodThreshold(float pixels)
+{
+  _lodThreshold = pixels;
+}
+
+//Get level of detail
+float FractalCube::getLodThreshold() const
+{
+  return _lodThreshold;
+}
+
+//Get drawn faces
+int FractalCube::getDrawnFaces() const
+{
+  return _drawnFaces;
+}
+
+//Get hidden faces
+int FractalCube::getHiddenFaces() const
+{
+  return _hiddenFaces;
+}
+
+//Draw sponge, subdivision is walked in the order stored levels keep cubes
+void FractalCube::renderInstances(Engine& renderer)
+{
+  _drawnFaces = _hiddenFaces = 0;
+  _pendingCubes.resize(cCubeParts);
+  renderCube(renderer, _baseCube, 1, 0, false);
+  for(int visible = 1; visible < cCubeParts; visible++)
+    flushCubes(renderer, visible);
+}
+
+//Draw cube or its sub cubes, cube holds all its sub cubes so sub tree
+//outside of view is left out with one test
+void FractalCube::renderCube(Engine& renderer, const FractalCube_t& cube, int level, int index, bool inside)
+{
+  float half = cube.size * 0.5f;
+  Point3_t center = {cube.f[0].a.x + half, cube.f[0].a.y - half, cube.f[0].a.z + half};
+
+  if(!inside) {
+    int volume = renderer.testSphere(center, half * cSqrt3);
+    if(volume == Engine::VOLUME_OUTSIDE)
       return;
-  } else {
-    if(_level > 4)
+    inside = (volume == Engine::VOLUME_INSIDE);
+  }
+
+  bool leaf = (level >= _level);
+  int visible = cube.visible;
+
+  //Sub cubes too small to show, a third of cube each, are drawn as cube.
+  //Faces were hidden against solid neighbours, but neighbour drawn deeper
+  //has tunnels ending at them, so every face is drawn
+  if(!leaf && (_lodThreshold > 0.0f) &&
+     (renderer.getProjectedSize(center, half * cSqrt3) < 3.0f * _lodThreshold)) {
+    leaf = true;
+    visible = cAllFaces;
+  }
+
+  if(leaf) {
+    Instance_t instance = instanceCube(cube, visible);
+    if(!visible)
       return;
+
+    InstanceList& cubes = _pendingCubes[visible];
+    cubes.push_back(instance);
+    if(cubes.size() >= static_cast<unsigned int>(cInstanceBatch))
+      flushCubes(renderer, visible);
+    return;
+  }
+
+  //Implicit sponge keeps only sub cubes of cubes on the way down
+  int count = subCubes();
+  FractalCube_t made[20];
+  const FractalCube_t* cubes;
+  if(_implicit) {
+    analyzeCube(cube, made);
+    cubes = made;
+  } else {
+    cubes = &_levels[level][index * count];
+  }
+
+  for(int i = 0; i < count; i++)
+    renderCube(renderer, cubes[i], level + 1, index * count + i, inside);
+}
+
+//Submit implicit cubes
+void FractalCube::flushCubes(Engine& renderer, int visible)
+{
+  InstanceList& cubes = _pendingCubes[visible];
+  if(cubes.empty())
+    return;
+
+  drawPart(renderer, visible, &cubes[0], cubes.size());
+  cubes.clear();
+}
+
+//Place unit cube, count drawn and hidden faces
+Instance_t FractalCube::instanceCube(const FractalCube_t& cube, int visible)
+{
+  for(int i = 0; i < 6; i++) {
+    if(visible & (1 << i))
+      _drawnFaces++;
+    else
+      _hiddenFaces++;
+  }
+
+  Instance_t instance;
+  instance.x = cube.f[0].a.x;
+  instance.y = cube.f[0].a.y;
+  instance.z = cube.f[0].a.z;
+  instance.scale = cube.size;
+  return instance;
+}
+
+//Make unit cube from base cube, every cube is base cube moved and scaled
+void FractalCube::makeUnitCube(FractalCube_t& cube, int visible) const
+{
+  cube = _baseCube;
+  for(int i = 0; i < 6; i++) {
+    toLocal(cube.f[i].a, _baseCube.f[0].a, _baseCube.size);
+    toLocal(cube.f[i].b, _baseCube.f[0].a, _baseCube.size);
+    toLocal(cube.f[i].c, _baseCube.f[0].a, _baseCube.size);
+    toLocal(cube.f[i].d, _baseCube.f[0].a, _baseCube.size);
   }
+  cube.size = 1.0f;
+  cube.visible = visible;
+}
 
-  FractalList temp;
-  copyList(_fractalCubesList, temp);
-  _fractalCubesList.clear();
+//Add level, stored if all levels fit in budget, implicit if only frame does
+void FractalCube::addLevel()
+{
+  ProfileZone zone(cZoneCubeLevel);
+
+  //Frame of every face is the same for stored and implicit sponge, every
+  //face is a strip of 4 vertices and 2 triangles
+  std::vector<double> counts;
+  countSubCubes(counts);
+  double numCubes = 0.0, numFaces = 0.0;
+  for(int visible = 0; visible < cCubeParts; visible++) {
+    numCubes += counts[visible];
+    numFaces += counts[visible] * countFaces(visible);
+  }
+  double frame = frameBytes(4.0 * numFaces, 2.0 * numFaces, cCubeParts);
+  if(!fitsBudget(_level + 1, frame))
+    return;
+
+  if(!_implicit) {
+    double stored = numCubes;
+    for(unsigned int i = 0; i < _levels.size(); i++)
+      stored += _levels[i].size();
+    stored *= sizeof(FractalCube_t);
+
+    if(stored + frame > static_cast<double>(getMemoryBudget())) {
+      std::ostringstream out;
+      out << "Level " << (_level + 1) << " cubes would take " << megabytes(stored)
+          << ", sponge is rendered implicitly";
+      notice(out.str());
+      _implicit = true;
+      _levels.resize(1);
+      invalidate();
+    }
+  }
 
-  FractalListIter iter;
-  for(iter = temp.begin(); iter != temp.end(); ++iter)
-    analyzeCube(*iter);
+  _counts.swap(counts);
 
-  temp.clear();
+  //Implicit sponge has nothing to build
+  if(_implicit) {
+    _level++;
+    return;
+  }
+
+  //Next level is built next to last one and swapped in, every parent
+  //writes its sub cubes at its own offset so order does not depend on threads
+  const FractalList& parents = _levels.back();
+  FractalList cubes(parents.size() * subCubes());
+
+  CubeLevel_t level;
+  level.fractal = this;
+  level.parents = &parents[0];
+  level.children = &cubes[0];
+  level.count = parents.size();
+  getPool().parallelFor(analyzeJob, &level, levelChunks(level.count));
+
+  _levels.push_back(FractalList());
+  _levels.back().swap(cubes);
   _level++;
+  invalidate();
+}
+
+//Sub cubes per cube, 20 of 27 are kept, inverse keeps the cross of 7
+int FractalCube::subCubes() const
+{
+  return _inverse ? 7 : 20;
+}
+
+//Count sub cubes, visible faces of sub cube depend only on its place and
+//on visible faces of its cube, so one cube of every kind is analyzed
+void FractalCube::countSubCubes(std::vector<double>& counts) const
+{
+  counts.assign(cCubeParts, 0.0);
+  FractalCube_t cubes[20];
+  for(int visible = 0; visible < cCubeParts; visible++) {
+    if(_counts[visible] == 0.0)
+      continue;
+
+    FractalCube_t cube;
+    makeUnitCube(cube, visible);
+    analyzeCube(cube, cubes);
+    for(int i = 0; i < subCubes(); i++)
+      counts[cubes[i].visible] += _counts[visible];
+  }
+}
+
+//Reset counts, level 1 is base cube with every face visible
+void FractalCube::resetCounts()
+{
+  _counts.assign(cCubeParts, 0.0);
+  _counts[_baseCube.visible] = 1.0;
+}
+
+//Cube keeps sub cubes off the center lines, inverse keeps the center cross
+bool FractalCube::keepsSubCube(int xi, int yi, int zi) const
+{
+  bool center = ((yi == 1) && (xi == 1)) || ((yi == 1) && (zi == 1)) || ((xi == 1) && (zi == 1));
+  return center == _inverse;
+}
+
+//Analyze chunk of parent cubes
+void FractalCube::analyzeJob(void* data, int chunk)
+{
+  const CubeLevel_t* level = static_cast<const CubeLevel_t*>(data);
+  int children = level->fractal->subCubes();
+  int first = chunk * cLevelChunk;
+  int last = std::min(first + cLevelChunk, level->count);
+
+  for(int i = first; i < last; i++)
+    level->fractal->analyzeCube(level->parents[i], level->children + i * children);
 }
 
 //Analyze cube, very hard algorithm :/
-void FractalCube::analyzeCube(FractalCube_t& cube)
+void FractalCube::analyzeCube(const FractalCube_t& cube, FractalCube_t* cubes) const
 {
   //size of new cube is 3 times smaller then the originals one
   float size = cube.size / 3.0f;
@@ -106,12 +639,21 @@ void FractalCube::analyzeCube(FractalCube_t& cube)
   for(int zi = 0; zi < 3; zi++) {
     for(int yi = 0; yi < 3; yi++) {
       for(int xi = 0; xi < 3; xi++) {
-        if(_inverse) {
-          if(!(((yi == 1) && (xi == 1)) || ((yi == 1) && (zi == 1)) || ((xi == 1) && (zi == 1))))
-            continue;
-        } else {
-          if((((yi == 1) && (xi == 1)) || ((yi == 1) && (zi == 1)) || ((xi == 1) && (zi == 1))))
-            continue;
+        if(!keepsSubCube(xi, yi, zi))
+          continue;
+
+        //Face is covered if neighbour sub cube is kept. Kept sub cubes are
+        //symmetric, so at the border of cube sub cubes of neighbour cube
+        //face them exactly where cube face is covered
+        nCube.visible = 0;
+        for(int i = 0; i < 6; i++) {
+          int nx = xi + cNeighbour[i][0];
+          int ny = yi + cNeighbour[i][1];
+          int nz = zi + cNeighbour[i][2];
+          if((nx < 0) || (nx > 2) || (ny < 0) || (ny > 2) || (nz < 0) || (nz > 2))
+            nCube.visible |= cube.visible & (1 << i);
+          else if(!keepsSubCube(nx, ny, nz))
+            nCube.visible |= 1 << i;
         }
 
         //Front
@@ -223,21 +765,33 @@ void FractalCube::analyzeCube(FractalCube_t& cube)
         nCube.f[4].color = cube.f[4].color;
         nCube.f[5].color = cube.f[5].color;
 
-        _fractalCubesList.push_back(nCube);
+        *cubes++ = nCube;
       }
     }
   }
 }
 
 //Draw cube
-void FractalCube::drawCube(Engine& renderer, const FractalCube_t& cube)
+void FractalCube::drawCube(Vertex2List& vertices, const FractalCube_t& cube)
 {
+  //Opposite corners of cube
+  Point3_t center;
+  center.x = (cube.f[0].a.x + cube.f[1].d.x) * 0.5f;
+  center.y = (cube.f[0].a.y + cube.f[1].d.y) * 0.5f;
+  center.z = (cube.f[0].a.z + cube.f[1].d.z) * 0.5f;
+
+  //Face points are not wound the same way on every face, swapping b and c
+  //turns face around and keeps its diagonal
   for(int i = 0; i < 6; i++) {
-    renderer.setColor(cube.f[i].color.r, cube.f[i].color.g, cube.f[i].color.b);
-    renderer.addVertex(cube.f[i].a.x, cube.f[i].a.y, cube.f[i].a.z);
-    renderer.addVertex(cube.f[i].b.x, cube.f[i].b.y, cube.f[i].b.z);
-    renderer.addVertex(cube.f[i].c.x, cube.f[i].c.y, cube.f[i].c.z);
-    renderer.addVertex(cube.f[i].d.x, cube.f[i].d.y, cube.f[i].d.z);
+    if(!(cube.visible & (1 << i)))
+      continue;
+
+    const FractalFace_t& f = cube.f[i];
+    bool outward = facesOutward(f.a, f.b, f.c, center);
+    pushVertex(vertices, f.a, f.color);
+    pushVertex(vertices, outward ? f.b : f.c, f.color);
+    pushVertex(vertices, outward ? f.c : f.b, f.color);
+    pushVertex(vertices, f.d, f.color);
   }
 }
 
@@ -300,8 +854,10 @@ void FractalCube::makeBaseFractal()
   cube.f[5].color.b = float((rand() % 200 + 50) / 255.0);
 
   cube.size = 2.0f * size;
+  cube.visible = 0x3F;
 
-  _fractalCubesList.push_back(cube);
+  _baseCube = cube;
+  _levels.assign(1, FractalList(1, cube));
 }
 
 
@@ -309,8 +865,6 @@ void FractalCube::makeBaseFractal()
 //Pyramid constructor
 FractalPyramid::FractalPyramid()
 {
-  _fractalPyramidsList.clear();
-
   size = 120.0f;
   _level = 1;
   _inverse = false;
@@ -321,21 +875,90 @@ FractalPyramid::FractalPyramid()
 //Pyramid destructor
 FractalPyramid::~FractalPyramid()
 {
-  _fractalPyramidsList.clear();
+  _levels.clear();
+}
+
+//Build pyramid parts, pyramids of last level differ only by position, so
+//they are copies of the first one placed at its apex. Bases are copies of
+//unit base scaled to pyramid they are under. Copies are chosen every frame
+//by renderInstances
+void FractalPyramid::buildParts(FractalPartList& parts)
+{
+  parts.resize(2);
+
+  //Base is one quad, drawn as strip of 4 vertices
+  FractalFace_t base;
+  makeUnitBase(base);
+  drawBase(parts[0].vertices, base);
+  parts[0].triangleMode = Engine::TRIANGLE_STRIP;
+
+  //Faces of pyramid differ in color, so they share no vertices
+  parts[1].triangleMode = Engine::TRIANGLE_NORMAL;
+  FractalPyramid_t pyr = _levels.back()[0];
+  Point3_t origin = pyr.f[0].a;
+  for(int i = 0; i < 4; i++) {
+    toLocal(pyr.f[i].a, origin, 1.0f);
+    toLocal(pyr.f[i].b, origin, 1.0f);
+    toLocal(pyr.f[i].c, origin, 1.0f);
+  }
+  drawPyramid(parts[1].vertices, pyr);
+}
+
+//Draw pyramids of last level, walking levels from the base pyramid
+void FractalPyramid::renderInstances(Engine& renderer)
+{
+  _pendingPyramids.resize(2);
+  renderPyramid(renderer, 1, 0, false);
+  flushPyramids(renderer, 0);
+  flushPyramids(renderer, 1);
 }
 
-//Render pyramid
-void FractalPyramid::render(Engine& renderer)
+//Draw pyramid or its sub pyramids, pyramid holds all its sub pyramids and
+//their bases so sub tree outside of view is left out with one test.
+//Bases of the 4 lower sub pyramids tile base of pyramid, so every base is
+//drawn once, whole, under base pyramid and under every upper sub pyramid
+void FractalPyramid::renderPyramid(Engine& renderer, int level, int index, bool inside)
 {
-  renderer.setTriangleMode(Engine::TRIANGLE_NORMAL);
-  FractalPyrListIter iter;
-  BaseListIter bIter;
+  const FractalPyramid_t& pyr = _levels[level - 1][index];
+
+  //Pyramid is as high as half its base is wide, sphere around its middle
+  //reaches base corners
+  if(!inside) {
+    Point3_t center = {pyr.f[0].a.x, pyr.f[0].a.y - pyr.size * 0.5f, pyr.f[0].a.z};
+    int volume = renderer.testSphere(center, pyr.size * 1.5f);
+    if(volume == Engine::VOLUME_OUTSIDE)
+      return;
+    inside = (volume == Engine::VOLUME_INSIDE);
+  }
 
-  for(bIter = _baseList.begin(); bIter != _baseList.end(); ++bIter)
-    drawBase(renderer, *bIter);
+  if((level == 1) || (index % 5 == 0)) {
+    Instance_t base = {pyr.f[0].a.x, pyr.f[0].a.y, pyr.f[0].a.z, pyr.size};
+    _pendingPyramids[0].push_back(base);
+    if(_pendingPyramids[0].size() >= static_cast<unsigned int>(cInstanceBatch))
+      flushPyramids(renderer, 0);
+  }
 
-  for(iter = _fractalPyramidsList.begin(); iter != _fractalPyramidsList.end(); ++iter)
-    drawPyramid(renderer, *iter);
+  if(level < _level) {
+    for(int i = 0; i < 5; i++)
+      renderPyramid(renderer, level + 1, index * 5 + i, inside);
+    return;
+  }
+
+  Instance_t instance = {pyr.f[0].a.x, pyr.f[0].a.y, pyr.f[0].a.z, 1.0f};
+  _pendingPyramids[1].push_back(instance);
+  if(_pendingPyramids[1].size() >= static_cast<unsigned int>(cInstanceBatch))
+    flushPyramids(renderer, 1);
+}
+
+//Submit pyramid instances
+void FractalPyramid::flushPyramids(Engine& renderer, int part)
+{
+  InstanceList& instances = _pendingPyramids[part];
+  if(instances.empty())
+    return;
+
+  drawPart(renderer, part, &instances[0], instances.size());
+  instances.clear();
 }
 
 
@@ -348,36 +971,63 @@ void FractalPyramid::handleInput(SDL_Event& event)
   }
 }
 
-//Add new level
-void FractalPyramid::addLevel()
+//Get level
+int FractalPyramid::getLevel() const
 {
-  if(!_inverse) {
-    if(_level > 6)
-      return;
-  } else {
-    if(_level > 4)
-      return;
-  }
+  return _level;
+}
 
-  FractalPyrList temp;
-  copyPyrList(_fractalPyramidsList, temp);
-  _fractalPyramidsList.clear();
+//Add new level if all levels and frame fit in budget
+void FractalPyramid::addLevel()
+{
+  ProfileZone zone(cZonePyramidLevel);
+
+  //Every pyramid is 4 triangles, every base is strip of 4 vertices, there
+  //is one base under base pyramid and one under every upper sub pyramid
+  double count = _levels.back().size() * 5.0;
+  double bases = 1.0 + (count - 1.0) / 4.0;
+  double stored = count;
+  for(unsigned int i = 0; i < _levels.size(); i++)
+    stored += _levels[i].size();
+  stored *= sizeof(FractalPyramid_t);
+  double frame = frameBytes(12.0 * count + 4.0 * bases, 4.0 * count + 2.0 * bases, 2);
+  if(!fitsBudget(_level + 1, stored + frame))
+    return;
+
+  //Next level is built next to last one and swapped in, every parent
+  //writes its sub pyramids at its own offset so order does not depend on threads
+  const FractalPyrList& parents = _levels.back();
+  FractalPyrList pyramids(parents.size() * 5);
+
+  PyramidLevel_t level;
+  level.fractal = this;
+  level.parents = &parents[0];
+  level.children = &pyramids[0];
+  level.count = parents.size();
+  getPool().parallelFor(analyzeJob, &level, levelChunks(level.count));
+
+  _levels.push_back(FractalPyrList());
+  _levels.back().swap(pyramids);
+  _level++;
+  invalidate();
+}
 
-  _baseList.clear();
-  FractalPyrListIter iter;
-  for(iter = temp.begin(); iter != temp.end(); ++iter)
-    analyzePyramid(*iter);
+//Analyze chunk of parent pyramids
+void FractalPyramid::analyzeJob(void* data, int chunk)
+{
+  const PyramidLevel_t* level = static_cast<const PyramidLevel_t*>(data);
+  int first = chunk * cLevelChunk;
+  int last = std::min(first + cLevelChunk, level->count);
 
-  temp.clear();
-  _level++;
+  for(int i = first; i < last; i++)
+    level->fractal->analyzePyramid(level->parents[i], level->children + i * 5);
 }
 
 //Analzye pyramid
-void FractalPyramid::analyzePyramid(FractalPyramid_t& pyr)
+void FractalPyramid::analyzePyramid(const FractalPyramid_t& pyr, FractalPyramid_t* pyramids)
 {
   float size = pyr.size / 2.0f;
   FractalPyramid_t nPyr;
-  FractalFace_t base;
   nPyr.size = size;
   float sizex, sizey, sizez;
   sizex = sizey = sizez = size;
@@ -436,25 +1086,7 @@ void FractalPyramid::analyzePyramid(FractalPyramid_t& pyr)
     nPyr.f[2].color = pyr.f[2].color;
     nPyr.f[3].color = pyr.f[3].color;
 
-    _fractalPyramidsList.push_back(nPyr);
-
-    base.a.x = startpx - sizex;
-    base.a.y = startpy - sizey;
-    base.a.z = startpz - sizez;
-    base.b.x = startpx - sizex;
-    base.b.y = startpy - sizey;
-    base.b.z = startpz + sizez;
-    base.c.x = startpx + sizex;
-    base.c.y = startpy - sizey;
-    base.c.z = startpz - sizez;
-    base.d.x = startpx + sizex;
-    base.d.y = startpy - sizey;
-    base.d.z = startpz + sizez;
-    base.color.r = 0.0;
-    base.color.g = 1.0;
-    base.color.b = 1.0;
-
-    _baseList.push_back(base);
+    pyramids[i - 1] = nPyr;
 
     if(i == 1){
       startpx -= sizex;
@@ -471,14 +1103,18 @@ void FractalPyramid::analyzePyramid(FractalPyramid_t& pyr)
 }
 
 //Draw single pyramid
-void FractalPyramid::drawPyramid(Engine& renderer, const FractalPyramid_t& pyr)
+void FractalPyramid::drawPyramid(Vertex2List& vertices, const FractalPyramid_t& pyr)
 {
+  //Average of face points lies inside
+  Point3_t center = {0.0f, 0.0f, 0.0f};
   for(int i = 0; i < 4; i++) {
-    renderer.setColor(pyr.f[i].color.r, pyr.f[i].color.g, pyr.f[i].color.b);
-    renderer.addVertex(pyr.f[i].a.x, pyr.f[i].a.y, pyr.f[i].a.z);
-    renderer.addVertex(pyr.f[i].b.x, pyr.f[i].b.y, pyr.f[i].b.z);
-    renderer.addVertex(pyr.f[i].c.x, pyr.f[i].c.y, pyr.f[i].c.z);
+    center.x += (pyr.f[i].a.x + pyr.f[i].b.x + pyr.f[i].c.x) / 12.0f;
+    center.y += (pyr.f[i].a.y + pyr.f[i].b.y + pyr.f[i].c.y) / 12.0f;
+    center.z += (pyr.f[i].a.z + pyr.f[i].b.z + pyr.f[i].c.z) / 12.0f;
   }
+
+  for(int i = 0; i < 4; i++)
+    pushTriangle(vertices, pyr.f[i].a, pyr.f[i].b, pyr.f[i].c, center, pyr.f[i].color);
 }
 
 //make base pyramid fractal
@@ -526,21 +1162,43 @@ void FractalPyramid::makeBaseFractal()
   base.color.g = float((rand() % 200 + 50) / 255.0);
   base.color.b = float((rand() % 200 + 50) / 255.0);
 
-  _baseList.push_back(base);
+  _base = base;
+  _levels.assign(1, FractalPyrList(1, pyr));
+}
 
-  _fractalPyramidsList.push_back(pyr);
+//Draw pyramid's base as strip
+void FractalPyramid::drawBase(Vertex2List& vertices, const FractalFace_t& base)
+{
+  //Base faces down, pyramid is above it
+  Point3_t above = base.a;
+  above.y += 1.0f;
+
+  bool outward = facesOutward(base.a, base.b, base.c, above);
+  pushVertex(vertices, base.a, base.color);
+  pushVertex(vertices, outward ? base.b : base.c, base.color);
+  pushVertex(vertices, outward ? base.c : base.b, base.color);
+  pushVertex(vertices, base.d, base.color);
 }
 
-//Draw pyramid's base
-void FractalPyramid::drawBase(Engine& renderer, const FractalFace_t& base)
+//Make unit base, base pyramid keeps its own base, on later levels every
+//base is the square under sub pyramid, as wide as twice its height
+void FractalPyramid::makeUnitBase(FractalFace_t& base) const
 {
-  //renderer.setTriangleMode(Engine::TRIANGLE_STRIP);
-  renderer.setColor(base.color.r, base.color.g, base.color.b);
-  renderer.addVertex(base.a.x, base.a.y, base.a.z);
-  renderer.addVertex(base.b.x, base.b.y, base.b.z);
-  renderer.addVertex(base.c.x, base.c.y, base.c.z);
+  if(_level == 1) {
+    const FractalPyramid_t& pyr = _levels[0][0];
+    base = _base;
+    toLocal(base.a, pyr.f[0].a, pyr.size);
+    toLocal(base.b, pyr.f[0].a, pyr.size);
+    toLocal(base.c, pyr.f[0].a, pyr.size);
+    toLocal(base.d, pyr.f[0].a, pyr.size);
+    return;
+  }
 
-  renderer.addVertex(base.b.x, base.b.y, base.b.z);
-  renderer.addVertex(base.c.x, base.c.y, base.c.z);
-  renderer.addVertex(base.d.x, base.d.y, base.d.z);
+  base.a.x = -1.0f; base.a.y = -1.0f; base.a.z = -1.0f;
+  base.b.x = -1.0f; base.b.y = -1.0f; base.b.z =  1.0f;
+  base.c.x =  1.0f; base.c.y = -1.0f; base.c.z = -1.0f;
+  base.d.x =  1.0f; base.d.y = -1.0f; base.d.z =  1.0f;
+  base.color.r = 0.0;
+  base.color.g = 1.0;
+  base.color.b = 1.0;
 }
@@ -7,11 +7,13 @@
 #ifndef FRACTAL_HPP_INCLUDED
 #define FRACTAL_HPP_INCLUDED
 
-#include <list>
+#include <vector>
+#include <string>
 
 #include <SDL/SDL.h>
 
 #include "api/Engine.hpp"
+#include "utils/ThreadPool.hpp"
 
 //Fractal cube face
 typedef struct{
@@ -27,8 +29,9 @@ typedef struct{
 
 //fractal cube
 typedef struct{
-  FractalFace_t f[6]; //faces
+  FractalFace_t f[6]; //faces, toward -z, +z, +y, -y, -x, +x
   float size;
+  int visible; //bit i is set if face f[i] is not covered by neighbour cube
 }FractalCube_t;
 
 //fractal pyramid
@@ -38,27 +41,163 @@ typedef struct{
 }FractalPyramid_t;
 
 //Fractal cube list
-typedef std::list<FractalCube_t> FractalList;
-typedef std::list<FractalCube_t>::iterator FractalListIter;
+typedef std::vector<FractalCube_t> FractalList;
+typedef std::vector<FractalCube_t>::iterator FractalListIter;
 
 //Fractal pyramid list
-typedef std::list<FractalPyramid_t> FractalPyrList;
-typedef std::list<FractalPyramid_t>::iterator FractalPyrListIter;
+typedef std::vector<FractalPyramid_t> FractalPyrList;
+typedef std::vector<FractalPyramid_t>::iterator FractalPyrListIter;
 
-//Fractal pyramid base list
-typedef std::list<FractalFace_t> BaseList;
-typedef std::list<FractalFace_t>::iterator BaseListIter;
+//Add vertex with given color to vertex list
+void pushVertex(Vertex2List& vertices, const Point3_t& point, const Color4_t& color);
 
-//Copy lists
-void copyList(FractalList& from, FractalList& to);
-void copyPyrList(FractalPyrList& from, FractalPyrList& to);
+//Check if triangle normal points away from inside point
+bool facesOutward(const Point3_t& a, const Point3_t& b, const Point3_t& c, const Point3_t& inside);
+
+//Add triangle wound outward, away from inside point
+void pushTriangle(Vertex2List& vertices, const Point3_t& a, const Point3_t& b, const Point3_t& c,
+                  const Point3_t& inside, const Color4_t& color);
+
+//Mesh fractal is drawn with and its copies
+typedef struct{
+  Vertex2List vertices; //One copy in object space
+  int triangleMode; //Engine triangle mode of vertices
+  InstanceList instances; //Copies, empty if they are chosen by renderInstances
+}FractalPart_t;
+
+//Fractal part list
+typedef std::vector<FractalPart_t> FractalPartList;
 
 class Fractal{
   public:
-    virtual void render(Engine& renderer) = 0;
+    /**
+    * Ctor
+    */
+    Fractal();
+
+    /**
+    * Dtor, destroys the meshes owned by renderer
+    */
+    virtual ~Fractal();
+
+    /**
+    * Render, fractal parts are rebuilt only if fractal changed
+    * @param renderer Renderer reference.
+    */
+    void render(Engine& renderer);
+
+    /**
+    * Set renderer fractal is drawn with, render sets it too. Memory of
+    * levels added before first frame is estimated with its pipeline depth.
+    * @param renderer Renderer reference.
+    */
+    void setRenderer(Engine& renderer);
+
     virtual void handleInput(SDL_Event& event) = 0;
 
-    virtual ~Fractal(){}
+    /**
+    * Add new level, does nothing if memory it needs is over budget
+    */
+    virtual void addLevel() = 0;
+
+    /**
+    * @return Current level, base fractal is level 1
+    */
+    virtual int getLevel() const = 0;
+
+    /**
+    * Set memory budget of levels and of frame they are drawn in
+    * @param bytes Budget in bytes.
+    */
+    void setMemoryBudget(Uint64 bytes);
+
+    /**
+    * @return Memory budget in bytes, half of physical memory by default
+    */
+    Uint64 getMemoryBudget() const;
+
+    /**
+    * @return Why last level was not added, empty if it was
+    */
+    const std::string& getRefusal() const;
+
+    /**
+    * Take messages about levels since last call: refused levels and
+    * change to implicit rendering. Fractal does not print them, it is up
+    * to caller.
+    * @return Messages, one per line, empty if there are none
+    */
+    std::string takeNotice();
+
+  protected:
+    /**
+    * Build meshes of fractal and their instances
+    * @param parts Part list to build into, every part gets its own mesh.
+    */
+    virtual void buildParts(FractalPartList& parts) = 0;
+
+    /**
+    * Draw instances chosen at draw time, after stored ones are drawn
+    * @param renderer Renderer reference.
+    */
+    virtual void renderInstances(Engine& renderer);
+
+    /**
+    * Draw instances of part mesh
+    * @param renderer Renderer reference.
+    * @param part Part index.
+    * @param instances Instances to draw.
+    * @param count Number of instances.
+    */
+    void drawPart(Engine& renderer, int part, const Instance_t* instances, int count);
+
+    /**
+    * Invalidate parts, they will be rebuilt on next render
+    */
+    void invalidate();
+
+    /**
+    * @return Pool building levels, created on first use
+    */
+    ThreadPool& getPool();
+
+    /**
+    * Check if level fits in memory budget, level that does not is refused
+    * @param level Level being added
+    * @param bytes Estimated memory of fractal at that level.
+    * @return true if level fits
+    */
+    bool fitsBudget(int level, double bytes);
+
+    /**
+    * Add message for caller, see takeNotice
+    * @param text Message
+    */
+    void notice(const std::string& text);
+
+    /**
+    * Estimate memory of frames fractal is drawn in
+    * @param vertices Vertices submitted per frame.
+    * @param triangles Triangles they make.
+    * @param parts Parts whose instances wait for drawing in batches.
+    * @return Bytes
+    */
+    double frameBytes(double vertices, double triangles, int parts) const;
+
+  private:
+    /**
+    * Destroy part meshes
+    */
+    void destroyMeshes();
+
+    Engine* _renderer;  /**< Renderer owning the meshes */
+    ThreadPool* _pool;  /**< Threads building levels, 0 until first level is added */
+    std::vector<int> _meshes;  /**< Mesh handle of every part */
+    std::vector<InstanceList> _instances;  /**< Stored instances of every part */
+    bool _dirty;  /**< Parts need rebuild */
+    Uint64 _memoryBudget;  /**< Memory levels may take */
+    std::string _refusal;  /**< Why last level was not added */
+    std::string _notice;  /**< Messages not taken yet */
 };
 
 class FractalCube: public Fractal{
@@ -72,36 +211,130 @@ class FractalCube: public Fractal{
     */
     ~FractalCube();
 
-    /**
-    * Render
-    * @param renderer Renderer reference.
-    */
-    void render(Engine& renderer);
-
     /**
     * Handle input
     * @param event Event list.
     */
     void handleInput(SDL_Event& event);
 
+    void addLevel();
+    int getLevel() const;
+
+    /**
+    * Switch implicit rendering. Stored sponge keeps cubes of every level,
+    * implicit one keeps only base cube and makes sub cubes while walking
+    * subdivision, so it goes deeper. Switching back rebuilds stored
+    * levels, sponge turns implicit again if they do not fit in budget.
+    * @param implicit Render implicitly.
+    */
+    void setImplicit(bool implicit);
+
+    /**
+    * @return true if sponge is rendered implicitly
+    */
+    bool isImplicit() const;
+
+    /**
+    * Set level of detail. Cube with sub cubes smaller on screen than
+    * threshold is drawn whole instead of them.
+    * @param pixels Threshold in pixels, 0 draws every cube at last level.
+    */
+    void setLodThreshold(float pixels);
+
+    /**
+    * @return Level of detail threshold in pixels
+    */
+    float getLodThreshold() const;
+
+    /**
+    * @return Faces drawn in last frame
+    */
+    int getDrawnFaces() const;
+
+    /**
+    * @return Faces left out in last frame, covered by neighbour cube
+    */
+    int getHiddenFaces() const;
+
+  protected:
+    void buildParts(FractalPartList& parts);
+    void renderInstances(Engine& renderer);
+
   private:
     /**
-    * Add new level
+    * Draw cube, subdividing it down to last level or level of detail
+    * @param renderer Renderer reference.
+    * @param cube Cube to draw
+    * @param level Level of cube
+    * @param index Index of cube in its stored level
+    * @param inside Cube is known to be whole inside of view
     */
-    void addLevel();
+    void renderCube(Engine& renderer, const FractalCube_t& cube, int level, int index, bool inside);
+
+    /**
+    * Submit cubes collected by renderCube
+    * @param renderer Renderer reference.
+    * @param visible Visible faces of cubes, part they are drawn with.
+    */
+    void flushCubes(Engine& renderer, int visible);
+
+    /**
+    * Place unit cube at cube and count faces drawn with it
+    * @param cube Cube
+    * @param visible Faces drawn
+    * @return Instance of unit cube
+    */
+    Instance_t instanceCube(const FractalCube_t& cube, int visible);
+
+    /**
+    * Make cube of size 1 with corner of face 0 point a at origin
+    * @param cube Cube to make
+    * @param visible Visible faces
+    */
+    void makeUnitCube(FractalCube_t& cube, int visible) const;
 
     /**
     * Analzye cube.
     * @param cube Cube to analyze
+    * @param cubes Place of subCubes() sub cubes
+    */
+    void analyzeCube(const FractalCube_t& cube, FractalCube_t* cubes) const;
+
+    /**
+    * Analyze chunk of cubes, job of level pool
+    * @param data Level being built
+    * @param chunk Chunk index
     */
-    void analyzeCube(FractalCube_t& cube);
+    static void analyzeJob(void* data, int chunk);
+
+    /**
+    * @return Number of sub cubes every cube is split to
+    */
+    int subCubes() const;
+
+    /**
+    * Count cubes of next level by visible faces, without making them
+    * @param counts Cubes by visible faces.
+    */
+    void countSubCubes(std::vector<double>& counts) const;
+
+    /**
+    * Reset level counters to base cube
+    */
+    void resetCounts();
+
+    /**
+    * @return true if sub cube is kept
+    * @param xi/yi/zi Position of sub cube in 3x3x3 lattice of cube.
+    */
+    bool keepsSubCube(int xi, int yi, int zi) const;
 
     /**
     * Draw Cube
-    * @param renderer Renderer reference.
+    * @param vertices Vertex list to draw into.
     * @param cube Cube to draw
     */
-    void drawCube(Engine& renderer, const FractalCube_t& cube);
+    void drawCube(Vertex2List& vertices, const FractalCube_t& cube);
 
     /**
     * Make Base cube fracal
@@ -111,8 +344,16 @@ class FractalCube: public Fractal{
     float size; /**< Size of cube */
     int _level; /**< Level */
     bool _inverse;  /**< Deprecated, not used, ignore */
+    bool _implicit;  /**< Sub cubes are not stored, they are made when drawn */
+    float _lodThreshold;  /**< Smallest cube size in pixels that is subdivided */
+
+    int _drawnFaces;  /**< Faces drawn in last frame */
+    int _hiddenFaces;  /**< Faces left out in last frame */
 
-    FractalList _fractalCubesList;  /**< Faracal cube list */
+    FractalCube_t _baseCube;  /**< Level 1 cube */
+    std::vector<FractalList> _levels;  /**< Cubes of every level, sub cubes of cube i follow at i * subCubes(), only level 1 if implicit */
+    std::vector<double> _counts;  /**< Cubes of last level by visible faces */
+    std::vector<InstanceList> _pendingCubes;  /**< Cubes not submitted yet, by visible faces */
 };
 
 class FractalPyramid: public Fractal{
@@ -127,36 +368,56 @@ class FractalPyramid: public Fractal{
     */
     ~FractalPyramid();
 
-    /**
-    * Render
-    * @param renderer Renderer reference.
-    */
-    void render(Engine& renderer);
-
     /**
     * Handle input
     * @param event Event list.
     */
     void handleInput(SDL_Event& event);
 
+    void addLevel();
+    int getLevel() const;
+
+  protected:
+    void buildParts(FractalPartList& parts);
+    void renderInstances(Engine& renderer);
+
   private:
     /**
-    * Add new level
+    * Draw pyramid and its base or its sub pyramids
+    * @param renderer Renderer reference.
+    * @param level Level of pyramid
+    * @param index Index of pyramid in its level
+    * @param inside Pyramid is known to be whole inside of view
     */
-    void addLevel();
+    void renderPyramid(Engine& renderer, int level, int index, bool inside);
+
+    /**
+    * Submit instances collected by renderPyramid
+    * @param renderer Renderer reference.
+    * @param part Part instances are drawn with.
+    */
+    void flushPyramids(Engine& renderer, int part);
 
     /**
     * Analzye pyramid.
     * @param pyr Pyramid to analyze
+    * @param pyramids Place of 5 sub pyramids
     */
-    void analyzePyramid(FractalPyramid_t& pyr);
+    void analyzePyramid(const FractalPyramid_t& pyr, FractalPyramid_t* pyramids);
+
+    /**
+    * Analyze chunk of pyramids, job of level pool
+    * @param data Level being built
+    * @param chunk Chunk index
+    */
+    static void analyzeJob(void* data, int chunk);
 
     /**
     * Draw Pyramid
-    * @param renderer Renderer reference.
+    * @param vertices Vertex list to draw into.
     * @param pyr Pyramid to draw
     */
-    void drawPyramid(Engine& renderer, const FractalPyramid_t& pyr);
+    void drawPyramid(Vertex2List& vertices, const FractalPyramid_t& pyr);
 
     /**
     * Make Base cube fracal
@@ -165,17 +426,24 @@ class FractalPyramid: public Fractal{
 
     /**
     * Draw Base
-    * @param renderer Renderer reference.
+    * @param vertices Vertex list to draw into.
     * @param base Base to draw
     */
-    void drawBase(Engine& renderer, const FractalFace_t& base);
+    void drawBase(Vertex2List& vertices, const FractalFace_t& base);
+
+    /**
+    * Make base under pyramid of size 1 with apex at origin
+    * @param base Base to make
+    */
+    void makeUnitBase(FractalFace_t& base) const;
 
     float size; /**< Size of puramid */
     int _level; /**< Level */
     bool _inverse;  /**< Deprecated, not used, ignore */
 
-    FractalPyrList _fractalPyramidsList;  /**< Faracal pyramid list */
-    BaseList _baseList;   /**< Faracal base list */
+    std::vector<FractalPyrList> _levels;  /**< Pyramids of every level, sub pyramids of pyramid i follow at i * 5 */
+    FractalFace_t _base;   /**< Base of level 1 pyramid */
+    std::vector<InstanceList> _pendingPyramids;  /**< Instances not submitted yet, by part */
 };
 
 #endif // FRACTAL_HPP_INCLUDED
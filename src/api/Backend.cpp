@@ -0,0 +1,68 @@
+/**
+* @file Backend.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of backend class.
+*/
+
+#include <cstdio>
+#include <vector>
+
+#include "Backend.hpp"
+#include "../utils/Exception.hpp"
+
+Backend::~Backend()
+{
+}
+
+void Backend::savePPM(const std::string& filename)
+{
+  SDL_Surface* surface = getSurface();
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if(file == 0)
+    throw Exception("Cannot open " + filename);
+
+  fprintf(file, "P6\n%d %d\n255\n", surface->w, surface->h);
+
+  if(SDL_MUSTLOCK(surface))
+    SDL_LockSurface(surface);
+
+  //Any pixel format is written as 8 bit RGB
+  const SDL_PixelFormat* format = surface->format;
+  int bytesPerPixel = format->BytesPerPixel;
+  std::vector<Uint8> row(surface->w * 3);
+
+  for(int y = 0; y < surface->h; y++) {
+    const Uint8* src = static_cast<const Uint8*>(surface->pixels) + y * surface->pitch;
+    for(int x = 0; x < surface->w; x++, src += bytesPerPixel) {
+      Uint32 pixel;
+      switch(bytesPerPixel) {
+        case 1: pixel = *src; break;
+        case 2: pixel = *reinterpret_cast<const Uint16*>(src); break;
+        #if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        case 3: pixel = (src[0] << 16) | (src[1] << 8) | src[2]; break;
+        #else
+        case 3: pixel = src[0] | (src[1] << 8) | (src[2] << 16); break;
+        #endif
+        default: pixel = *reinterpret_cast<const Uint32*>(src); break;
+      }
+      SDL_GetRGB(pixel, surface->format, &row[x * 3], &row[x * 3 + 1], &row[x * 3 + 2]);
+    }
+    fwrite(&row[0], 1, row.size(), file);
+  }
+
+  if(SDL_MUSTLOCK(surface))
+    SDL_UnlockSurface(surface);
+
+  bool failed = (ferror(file) != 0);
+  fclose(file);
+
+  if(failed)
+    throw Exception("Cannot write " + filename);
+}
+
+void Backend::saveBMP(const std::string& filename)
+{
+  if(SDL_SaveBMP(getSurface(), filename.c_str()) != 0)
+    throw Exception("Cannot write " + filename);
+}
@@ -0,0 +1,40 @@
+/**
+* @file Backend.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of backend class.
+* Backend owns the surface engine renders into and shows finished frames.
+*/
+
+#ifndef BACKEND_HPP_INCLUDED
+#define BACKEND_HPP_INCLUDED
+
+#include <string>
+
+#include <SDL/SDL.h>
+
+class Backend{
+  public:
+    /** Destructor. */
+    virtual ~Backend();
+
+    /** @return Surface frames are rendered into. */
+    virtual SDL_Surface* getSurface() = 0;
+
+    /** Show finished frame. */
+    virtual void present() = 0;
+
+    /** @return true if backend has window with menu, fonts and input. */
+    virtual bool isInteractive() const = 0;
+
+    /** Save last frame as binary PPM.
+    * @param filename File to save into.
+    */
+    void savePPM(const std::string& filename);
+
+    /** Save last frame as BMP.
+    * @param filename File to save into.
+    */
+    void saveBMP(const std::string& filename);
+};
+
+#endif // BACKEND_HPP_INCLUDED
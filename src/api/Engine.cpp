@@ -6,83 +6,169 @@
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
 #include <string>
+#include <algorithm>
+#include <limits>
 
 #include <SDL/SDL_image.h>
-#include <SDL/SDL_draw.h>
 
 #include "Engine.hpp"
+#include "PixelFormat.hpp"
+#include "WindowBackend.hpp"
 #include "../utils/Exception.hpp"
 #include "../math/Math.hpp"
-
+#include "../math/Transform.hpp"
+#include "../math/Cpu.hpp"
+#include "../utils/Memory.hpp"
+#include "../utils/Timer.hpp"
+#include "../utils/Profiler.hpp"
+
+/* Half space kernels evaluate attributes as row start + index * step with
+* separate multiply and add, scalar kernel must not be contracted into fma
+* so it rounds like pixel blocks do. */
+#if defined(__GNUC__) && !defined(__clang__)
+  #pragma GCC optimize("fp-contract=off")
+#elif defined(__clang__)
+  #pragma STDC FP_CONTRACT OFF
+#elif defined(_MSC_VER)
+  #pragma fp_contract(off)
+#endif
+
+const int cVertexListReserve = 65536; /**< Vertices reserved up front for render list. */
+const int cTileSize = 64; /**< Width and height of raster tile in pixels. */
+const int cSubPixelBits = 4; /**< Fractional bits of fixed point vertex coords. */
+const int cSubPixel = 1 << cSubPixelBits; /**< Fixed point one. */
+const float cGuardBand = 8192.0f; /**< Max projected coord handled by half space setup. */
+const int cEdgeClamp = 1 << 30; /**< Edge values beyond it keep their sign over whole tile. */
+const float cNearPlane = 1.0f; /**< Closest distance from the eye that is drawn. */
+const float cClipGuardBand = 4096.0f; /**< Triangles are clipped this far off screen. */
+const int cMaxClipVertices = 3 + 5; /**< Triangle clipped by 5 planes. */
+const int cIdleFrameRate = 10; /**< Frames per second of idle pacing. */
+
+//Profiling zones
+const int cZoneClearZbuffer = Profiler::getInstance().registerZone("clearZbuffer");
+const int cZoneTransform = Profiler::getInstance().registerZone("transformVertices");
+const int cZoneProcessDrawing = Profiler::getInstance().registerZone("processDrawing", true);
+const int cZoneBin = Profiler::getInstance().registerZone("binTriangles");
+const int cZoneRaster = Profiler::getInstance().registerZone("raster");
+const int cZoneRasterTile = Profiler::getInstance().registerZone("rasterTile", true);
+const int cZonePresent = Profiler::getInstance().registerZone("present");
+const int cZonePacing = Profiler::getInstance().registerZone("pacing");
 
 Engine::Engine(int width, int height, int bpp, bool fullscreen)
 {
-  if(SDL_Init(SDL_INIT_VIDEO) == -1)
-    throw Exception("Cannot initialize SDL");
+  init(new WindowBackend(width, height, bpp, fullscreen));
+}
 
-  Uint32 flags = SDL_SWSURFACE | SDL_DOUBLEBUF;
-  if(fullscreen)
-    flags |= SDL_FULLSCREEN;
+Engine::Engine(Backend* backend)
+{
+  init(backend);
+}
 
-  if((_screen = SDL_SetVideoMode(width, height, bpp, flags)) == 0)
-    throw Exception("Cannot set video mode");
+void Engine::init(Backend* backend)
+{
+  _backend = backend;
+  _screen = _backend->getSurface();
+  bool interactive = _backend->isInteractive();
 
-  _window.width = width;
-  _window.height = height;
-  _window.bpp = bpp;
-  _window.fullscreen = fullscreen;
+  _window.width = _screen->w;
+  _window.height = _screen->h;
+  _window.bpp = _screen->format->BitsPerPixel;
+  _window.fullscreen = (_screen->flags & SDL_FULLSCREEN) != 0;
 
   _currentColor.r = _currentColor.g = _currentColor.b =_currentColor.a = 1.0f;
   _clearColor = SDL_MapRGB(_screen->format, 128, 128, 128);
-  _vertexList.clear();
+  _vertexList.reserve(cVertexListReserve);
+  _batchList.clear();
+
+  //Select transform kernel once, before any drawing
+  getTransformKernel();
 
   _perspectiveRatio = 2500.0f;
+  setupClipPlanes();
 
-  SDL_WM_SetCaption("3D fractals!", 0);
-  SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+  memset(&_lastStats, 0, sizeof(_lastStats));
+  memset(&_times, 0, sizeof(_times));
+  _lastTimes = _times;
 
-  _engineState = MAIN_MENU_STATE;
+  _pacing = PACING_UNCAPPED;
+  _frameBudget = 1000000000ULL / 60;
+  _frameDeadline = 0;
 
-  if(TTF_Init() == -1) {
-    std::cout << "Cannot init ttf" << std::endl;
-    _font = 0;
-  } else {
-    _font = TTF_OpenFont("res/Vera.ttf", 14);
-    if(_font == 0)
-      std::cout << "Cannot load Vera.ttf font" << std::endl;
-  }
+  _font = 0;
+  _menu = 0;
+  _menuBg = 0;
 
-  _menu = new MainMenu(_font);
+  //Without window there is no menu to show, draw frames right away
+  if(interactive) {
+    _engineState = MAIN_MENU_STATE;
 
-  _isRunning = true;
+    if(TTF_Init() == -1) {
+      std::cout << "Cannot init ttf" << std::endl;
+    } else {
+      _font = TTF_OpenFont("res/Vera.ttf", 14);
+      if(_font == 0)
+        std::cout << "Cannot load Vera.ttf font" << std::endl;
+    }
 
-  _menuBg = 0;
+    _menu = new MainMenu(_font);
+
+    _menuBg = IMG_Load("res/menu.gif");
 
-  _menuBg = IMG_Load("res/menu.gif");
+    if(_menuBg == 0)
+      std::cout << "Cannot load menu background." << std::endl;
+  } else {
+    _engineState = GAME_STATE;
+  }
 
-  if(_menuBg == 0)
-    std::cout << "Cannot load menu background." << std::endl;
+  _isRunning = true;
 
   _lastTime = SDL_GetTicks();
 
   _renderMode = RENDER_LINES;
   _triangleMode = TRIANGLE_NORMAL;
 
-  _zbuffer = new ZBuffer_t*[_window.width];
+  //Rows start on cache line
+  int rowAlign = cCacheLineSize / sizeof(float);
+  _depthPitch = (_window.width + rowAlign - 1) / rowAlign * rowAlign;
+  _depthPlane = static_cast<float*>(alignedMalloc(_depthPitch * _window.height * sizeof(float)));
+
+  selectPixelFormat();
+
+  _tilesX = (_window.width + cTileSize - 1) / cTileSize;
+  _tilesY = (_window.height + cTileSize - 1) / cTileSize;
+  _tileBins.resize(_tilesX * _tilesY);
+  _tileClear.assign(_tilesX * _tilesY, 1);
 
-  for(int i = 0; i < _window.width; i++)
-    _zbuffer[i] = new ZBuffer_t[_window.height];
+  _drawFrame = 0;
+  _renderThread = 0;
+  _frameMutex = SDL_CreateMutex();
+  _frameCond = SDL_CreateCond();
+  if((_frameMutex == 0) || (_frameCond == 0))
+    throw Exception("Cannot create frame synchronization objects");
+  _framesSubmitted = _framesDrawn = 0;
+  _quitRender = false;
+  setPipelineDepth(1);
+
+  _rasterPool = 0;
+  _rasterNode = 0;
+  setRasterThreads(getNumProcessors());
+
+  _rasterizer = RASTER_SCANLINE;
+  setPixelKernel(PIXELS_AVX2);
 
   #ifdef _DEBUG
   SDL_Color cl = {255, 0, 0, 0};
   _pfRegistred = 0;
-  _pfRegistred = TTF_RenderText_Blended(_font, "Debug Info Saved to stdout.txt", cl);
+  if(interactive)
+    _pfRegistred = TTF_RenderText_Blended(_font, "Debug Info Saved to stdout.txt", cl);
   #endif
 
   SDL_Color credit = {255, 255, 255, 0};
   _credit = 0;
-  _credit = TTF_RenderText_Blended(_font, "All right reserved to Dmitri Koudriavtsev, Yud-bet1 Shevah Mofet", credit);
+  if(interactive)
+    _credit = TTF_RenderText_Blended(_font, "All right reserved to Dmitri Koudriavtsev, Yud-bet1 Shevah Mofet", credit);
 
   _vertices = 0;
 
@@ -112,16 +198,23 @@ Engine::~Engine()
   if(TTF_WasInit())
     TTF_Quit();
 
-  for(int i = 0; i < _window.width; i++)
-    delete []_zbuffer[i];
-  delete []_zbuffer;
+  finishFrames(false);
+  stopRenderThread();
+  destroyFrames();
+  SDL_DestroyCond(_frameCond);
+  SDL_DestroyMutex(_frameMutex);
+
+  alignedFree(_depthPlane);
 
-  if(SDL_WasInit(SDL_INIT_VIDEO))
-    SDL_Quit();
+  if(_rasterPool)
+    delete _rasterPool;
+
+  delete _backend;
 }
 
 void Engine::loadIdentity()
 {
+  flushVertices();
   _modelviewMatrix.identity();
   _modelviewMatrix.createTranslation(static_cast<float>(_window.width / 2),
                                      static_cast<float>(_window.height / 2),
@@ -133,6 +226,7 @@ void Engine::translate(float dx, float dy, float dz)
   Matrix temp;
   temp.createTranslation(dx, dy, dz);
 
+  flushVertices();
   _modelviewMatrix = _modelviewMatrix * temp;
 }
 
@@ -146,6 +240,7 @@ void Engine::rotate(float angle, int x, int y, int z)
   else if(z)
     temp.createRotationZ(angle);
 
+  flushVertices();
   _modelviewMatrix = _modelviewMatrix * temp;
 }
 
@@ -168,27 +263,55 @@ void Engine::clearScreen()
 
 void Engine::clearZbuffer()
 {
-  #ifdef _DEBUG
-  _pfManager.getInstance().start("ZBuffer cleaning");
-  #endif
-  for(int i = 0; i < _window.width; i++) {
-    for(int j = 0; j < _window.height; j++) {
-      _zbuffer[i][j].z = 0;
-      _zbuffer[i][j].color = _clearColor;
-    }
-  }
-  #ifdef _DEBUG
-  _pfManager.getInstance().stop("ZBuffer cleaning");
-  #endif
+  ProfileZone zone(cZoneClearZbuffer);
+  std::fill(_tileClear.begin(), _tileClear.end(), 1);
 }
 
 void Engine::updateScreen()
 {
+  Frame_t* shown = 0;
+
   if(_engineState == MAIN_MENU_STATE) {
+    finishFrames(false);
     _menu->draw(_screen);
+    _submitList.clear();
     _vertexList.clear();
+    _batchList.clear();
   } else if(_engineState == GAME_STATE) {
-    processDrawing();
+    flushVertices();
+    Uint64 number = _framesSubmitted;
+    Frame_t* frame = submitFrame();
+    int depth = _frames.size();
+
+    if(depth == 1) {
+      lockTarget();
+
+      //Pixels may move between locks
+      if(_zeroCopy) {
+        frame->colorPlane = static_cast<Uint8*>(_screen->pixels);
+        frame->colorPitch = _screen->pitch;
+      }
+
+      processDrawing(*frame);
+      _framesSubmitted = _framesDrawn = number + 1;
+      shown = frame;
+    } else {
+      SDL_LockMutex(_frameMutex);
+      _framesSubmitted = number + 1;
+      SDL_CondBroadcast(_frameCond);
+      SDL_UnlockMutex(_frameMutex);
+
+      //Oldest frame in flight is shown, its slot takes next frame
+      Frame_t* oldest = _frames[(number + 1) % depth];
+      if(oldest->pending) {
+        waitFrame(number + 1 - depth);
+        lockTarget();
+        shown = oldest;
+      }
+    }
+
+    if(shown)
+      _lastStats = shown->stats;
   }
 
   //Update FPS
@@ -201,11 +324,14 @@ void Engine::updateScreen()
     frames = 0;
     _lastTime = SDL_GetTicks();
   }
-  char f[64];
+  char f[128];
+  int culled = _lastStats.backFacing + _lastStats.outsideFrustum;
   #ifdef _DEBUG
-  sprintf(f, "DEBUG MODE. Frames per second: %d Vertices: %d", fps, _vertices);
+  sprintf(f, "DEBUG MODE. Frames per second: %d Vertices: %d Triangles: %d Culled: %d",
+          fps, _vertices, _lastStats.drawn, culled);
   #else
-  sprintf(f, "Frames per second: %d Vertices: %d", fps, _vertices);
+  sprintf(f, "Frames per second: %d Vertices: %d Triangles: %d Culled: %d",
+          fps, _vertices, _lastStats.drawn, culled);
   #endif
 
   SDL_Surface* fpsSurf;
@@ -214,19 +340,18 @@ void Engine::updateScreen()
   r.x = 5;
   r.y = 5;
 
-  #ifdef _DEBUG
-  _pfManager.getInstance().start("Drawing");
-  #endif
-  if(_engineState == GAME_STATE) {
-    for(Sint16 i = 0; i < _window.width; i++)
-      for(Sint16 j = 0; j < _window.height; j++)
-        Draw_Pixel(_screen, i, j, _zbuffer[i][j].color);
+  ProfileZone presentZone(cZonePresent);
+  Uint64 presentStart = getTimeNs();
+
+  if(shown) {
+    presentTiles(*shown);
+    unlockTarget();
+    shown->pending = false;
   }
 
   #ifdef _DEBUG
-  _pfManager.getInstance().stop("Drawing");
   if(_engineState == MAIN_MENU_STATE) {
-    if(_pfManager.getInstance().saved()) {
+    if(Profiler::getInstance().saved()) {
       static SDL_Rect r;
       r.x = 30;
       r.y = 70;
@@ -235,13 +360,171 @@ void Engine::updateScreen()
   }
   #endif
 
-  fpsSurf = TTF_RenderUTF8_Blended(_font, f, c);
-  SDL_BlitSurface(fpsSurf, NULL, _screen, &r);
+  //Headless frames are kept clean of overlay text
+  if(_backend->isInteractive()) {
+    fpsSurf = TTF_RenderUTF8_Blended(_font, f, c);
+    SDL_BlitSurface(fpsSurf, NULL, _screen, &r);
 
-  SDL_FreeSurface(fpsSurf);
+    SDL_FreeSurface(fpsSurf);
+  }
 
   //Flip buffers
-  SDL_Flip(_screen);
+  _backend->present();
+
+  if(shown)
+    _lastTimes = shown->times;
+  else
+    memset(&_lastTimes, 0, sizeof(_lastTimes));
+  _lastTimes.present = getTimeNs() - presentStart;
+
+  paceFrame();
+}
+
+Frame_t* Engine::submitFrame()
+{
+  Frame_t* frame = _frames[_framesSubmitted % _frames.size()];
+
+  //Slot lists were emptied when it was drawn, they come back for submitting
+  frame->vertices.swap(_vertexList);
+  frame->batches.swap(_batchList);
+  frame->tileClear.swap(_tileClear);
+
+  //Input may change settings while frame is drawn
+  frame->renderMode = _renderMode;
+  frame->rasterizer = _rasterizer;
+  frame->enableLight = _enableLight;
+
+  frame->times = _times;
+  memset(&_times, 0, sizeof(_times));
+  frame->pending = true;
+
+  _vertices = frame->vertices.size();
+  return frame;
+}
+
+void Engine::waitFrame(Uint64 number)
+{
+  SDL_LockMutex(_frameMutex);
+  while(_framesDrawn <= number)
+    SDL_CondWait(_frameCond, _frameMutex);
+  SDL_UnlockMutex(_frameMutex);
+}
+
+void Engine::finishFrames(bool keepNewest)
+{
+  SDL_LockMutex(_frameMutex);
+  while(_framesDrawn < _framesSubmitted)
+    SDL_CondWait(_frameCond, _frameMutex);
+  SDL_UnlockMutex(_frameMutex);
+
+  //Newest frame is the last one submitted, frames before it are outdated.
+  //It waits on screen for next updateScreen to flip it
+  if(keepNewest && (_framesSubmitted > 0)) {
+    Frame_t* newest = _frames[(_framesSubmitted - 1) % _frames.size()];
+    if(newest->pending) {
+      lockTarget();
+      presentTiles(*newest);
+      unlockTarget();
+      _lastStats = newest->stats;
+    }
+  }
+
+  for(unsigned int i = 0; i < _frames.size(); i++)
+    _frames[i]->pending = false;
+}
+
+void Engine::stopRenderThread()
+{
+  if(!_renderThread)
+    return;
+
+  SDL_LockMutex(_frameMutex);
+  _quitRender = true;
+  SDL_CondBroadcast(_frameCond);
+  SDL_UnlockMutex(_frameMutex);
+
+  SDL_WaitThread(_renderThread, 0);
+  _renderThread = 0;
+  _quitRender = false;
+}
+
+void Engine::destroyFrames()
+{
+  for(unsigned int i = 0; i < _frames.size(); i++) {
+    if(!_zeroCopy)
+      alignedFree(_frames[i]->colorPlane);
+    delete _frames[i];
+  }
+  _frames.clear();
+}
+
+int Engine::renderMain(void* engine)
+{
+  Engine* self = static_cast<Engine*>(engine);
+
+  SDL_LockMutex(self->_frameMutex);
+  while(true) {
+    while(!self->_quitRender && (self->_framesDrawn == self->_framesSubmitted))
+      SDL_CondWait(self->_frameCond, self->_frameMutex);
+
+    if(self->_quitRender)
+      break;
+
+    Frame_t* frame = self->_frames[self->_framesDrawn % self->_frames.size()];
+    SDL_UnlockMutex(self->_frameMutex);
+
+    self->processDrawing(*frame);
+
+    SDL_LockMutex(self->_frameMutex);
+    self->_framesDrawn++;
+    SDL_CondBroadcast(self->_frameCond);
+  }
+  SDL_UnlockMutex(self->_frameMutex);
+
+  return 0;
+}
+
+void Engine::setPipelineDepth(int depth)
+{
+  if(depth < 1)
+    depth = 1;
+
+  if(static_cast<int>(_frames.size()) == depth)
+    return;
+
+  //Frames in flight go with their slots, newest one is kept on screen
+  finishFrames(true);
+  stopRenderThread();
+  destroyFrames();
+
+  //Screen can be drawn into only when it is not shown at the same time
+  _zeroCopy = _canZeroCopy && (depth == 1);
+
+  for(int i = 0; i < depth; i++) {
+    Frame_t* frame = new Frame_t;
+    frame->tileClear.assign(_tilesX * _tilesY, 1);
+    frame->colorPlane = 0;
+    frame->colorPitch = 0;
+    if(!_zeroCopy) {
+      frame->colorPitch = _depthPitch * _colorBytes;
+      frame->colorPlane = static_cast<Uint8*>(alignedMalloc(frame->colorPitch * _window.height));
+    }
+    memset(&frame->stats, 0, sizeof(frame->stats));
+    memset(&frame->times, 0, sizeof(frame->times));
+    frame->pending = false;
+    _frames.push_back(frame);
+  }
+
+  if(depth > 1) {
+    _renderThread = SDL_CreateThread(renderMain, this);
+    if(_renderThread == 0)
+      throw Exception("Cannot create render thread");
+  }
+}
+
+int Engine::getPipelineDepth() const
+{
+  return _frames.size();
 }
 
 void Engine::setColor(float r, float g, float b, float a)
@@ -277,19 +560,235 @@ void Engine::setColor(float r, float g, float b, float a)
 
 void Engine::addVertex(float x, float y, float z)
 {
+  Vertex2_t vtmp;
+  vtmp.color = _currentColor;
+  vtmp.point.x = x;
+  vtmp.point.y = y;
+  vtmp.point.z = z;
 
-  Vector tmp(x, y, z);
+  //Transformed with vertices added after it under same model view
+  _submitList.append(&vtmp, 1);
+}
 
-  //Get coordiantes in world space;
-  tmp = _modelviewMatrix * tmp;
+void Engine::submitVertices(const Vertex2_t* vertices, int count)
+{
+  submitVertices(vertices, count, _triangleMode, false);
+}
 
-  Vertex2_t vtmp;
-  vtmp.color = _currentColor;
-  vtmp.point.x = tmp[0];
-  vtmp.point.y = tmp[1];
-  vtmp.point.z = tmp[2];
+void Engine::submitVertices(const Vertex2_t* vertices, int count, int triangleMode, bool cullBackFaces)
+{
+  if(count <= 0)
+    return;
+
+  flushVertices();
+  _submitList.append(vertices, count);
+  transformVertices(_submitList, (triangleMode == TRIANGLE_STRIP) ? TRIANGLE_STRIP : TRIANGLE_NORMAL,
+                    cullBackFaces, true);
+  _submitList.clear();
+}
+
+void Engine::flushVertices()
+{
+  if(_submitList.empty())
+    return;
+
+  transformVertices(_submitList, _triangleMode, false, true);
+  _submitList.clear();
+}
+
+int Engine::createMesh()
+{
+  Mesh_t mesh;
+  mesh.triangleMode = TRIANGLE_NORMAL;
+  mesh.cullBackFaces = false;
+  mesh.used = true;
+
+  //Reuse slot of destroyed mesh
+  for(unsigned int i = 0; i < _meshList.size(); i++) {
+    if(!_meshList[i].used) {
+      _meshList[i] = mesh;
+      return i;
+    }
+  }
 
-  _vertexList.push_back(vtmp);
+  _meshList.push_back(mesh);
+  return _meshList.size() - 1;
+}
+
+void Engine::setMeshVertices(int mesh, const Vertex2_t* vertices, int count, int triangleMode)
+{
+  if(!meshValid(mesh))
+    throw Exception("Trying to access to invalid mesh");
+
+  Mesh_t& m = _meshList[mesh];
+  //Emptied mesh gives its memory back
+  if(count <= 0)
+    VertexStream().swap(m.vertices);
+  m.vertices.clear();
+  m.vertices.append(vertices, count);
+  m.triangleMode = (triangleMode == TRIANGLE_STRIP) ? TRIANGLE_STRIP : TRIANGLE_NORMAL;
+}
+
+void Engine::setMeshCulling(int mesh, bool cullBackFaces)
+{
+  if(!meshValid(mesh))
+    throw Exception("Trying to access to invalid mesh");
+
+  _meshList[mesh].cullBackFaces = cullBackFaces;
+}
+
+void Engine::drawMesh(int mesh)
+{
+  if(!meshValid(mesh))
+    throw Exception("Trying to access to invalid mesh");
+
+  flushVertices();
+  const Mesh_t& m = _meshList[mesh];
+  transformVertices(m.vertices, m.triangleMode, m.cullBackFaces, false);
+}
+
+void Engine::drawInstanced(int mesh, const Instance_t* instances, int count)
+{
+  if(!meshValid(mesh))
+    throw Exception("Trying to access to invalid mesh");
+
+  flushVertices();
+  const Mesh_t& m = _meshList[mesh];
+  int size = m.vertices.size();
+  if((size <= 0) || (count <= 0))
+    return;
+
+  ProfileZone zone(cZoneTransform);
+  Uint64 start = getTimeNs();
+
+  appendBatch(size * count, m.triangleMode, m.cullBackFaces, false);
+
+  int first = _vertexList.size();
+  _vertexList.resize(first + size * count);
+
+  const float* modelview = _modelviewMatrix.data();
+  const Color4_t* color = m.vertices.color();
+  float matrix[cMatrixSize];
+
+  for(int i = 0; i < count; i++) {
+    const Instance_t& instance = instances[i];
+
+    //Model view * translate(offset) * scale(scale), column major
+    for(int j = 0; j < 12; j++)
+      matrix[j] = modelview[j] * instance.scale;
+    for(int j = 0; j < 4; j++)
+      matrix[12 + j] = modelview[j] * instance.x + modelview[4 + j] * instance.y +
+                       modelview[8 + j] * instance.z + modelview[12 + j];
+
+    int out = first + i * size;
+    transformPoints(matrix, m.vertices.x(), m.vertices.y(), m.vertices.z(),
+                    _vertexList.x() + out, _vertexList.y() + out, _vertexList.z() + out, size);
+    std::copy(color, color + size, _vertexList.color() + out);
+  }
+
+  _times.transform += getTimeNs() - start;
+}
+
+float Engine::getProjectedSize(const Point3_t& center, float radius) const
+{
+  const float* m = _modelviewMatrix.data();
+
+  //Model view is rotation and translation, scale is taken from first column anyway
+  float z = m[2] * center.x + m[6] * center.y + m[10] * center.z + m[14];
+  float r = radius * sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+
+  float depth = _perspectiveRatio + z - r;
+  if(depth < cNearPlane)
+    return std::numeric_limits<float>::infinity();
+
+  return 2.0f * r * _perspectiveRatio / depth;
+}
+
+int Engine::testSphere(const Point3_t& center, float radius) const
+{
+  const float* m = _modelviewMatrix.data();
+
+  Point3_t c;
+  c.x = m[0] * center.x + m[4] * center.y + m[8] * center.z + m[12];
+  c.y = m[1] * center.x + m[5] * center.y + m[9] * center.z + m[13];
+  c.z = m[2] * center.x + m[6] * center.y + m[10] * center.z + m[14];
+  float r = radius * sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+
+  //Planes are not normalized, distance is scaled by normal length
+  int result = VOLUME_INSIDE;
+  for(int i = 0; i < 5; i++) {
+    const ClipPlane_t& plane = _frustumPlanes[i];
+    float distance = plane.a * c.x + plane.b * c.y + plane.c * c.z + plane.d;
+    float reach = r * sqrtf(plane.a * plane.a + plane.b * plane.b + plane.c * plane.c);
+    if(distance < -reach)
+      return VOLUME_OUTSIDE;
+    if(distance < reach)
+      result = VOLUME_INTERSECTS;
+  }
+
+  return result;
+}
+
+void Engine::destroyMesh(int mesh)
+{
+  if(!meshValid(mesh))
+    return;
+
+  _meshList[mesh].used = false;
+  VertexStream().swap(_meshList[mesh].vertices);
+}
+
+bool Engine::meshValid(int mesh) const
+{
+  return ((mesh >= 0) && (mesh < static_cast<int>(_meshList.size())) && _meshList[mesh].used);
+}
+
+void Engine::transformVertices(const VertexStream& vertices, int triangleMode, bool cullBackFaces, bool continues)
+{
+  int count = vertices.size();
+  if(count <= 0)
+    return;
+
+  ProfileZone zone(cZoneTransform);
+  Uint64 start = getTimeNs();
+
+  appendBatch(count, triangleMode, cullBackFaces, continues);
+
+  int first = _vertexList.size();
+  _vertexList.resize(first + count);
+
+  //Get coordiantes in world space
+  transformPoints(_modelviewMatrix.data(), vertices.x(), vertices.y(), vertices.z(),
+                  _vertexList.x() + first, _vertexList.y() + first, _vertexList.z() + first,
+                  count);
+
+  const Color4_t* color = vertices.color();
+  std::copy(color, color + count, _vertexList.color() + first);
+
+  _times.transform += getTimeNs() - start;
+}
+
+void Engine::appendBatch(int count, int triangleMode, bool cullBackFaces, bool continues)
+{
+  int groupSize = (triangleMode == TRIANGLE_STRIP) ? 4 : 3;
+
+  //Extend last batch if it has same mode, incomplete triangle is left
+  //behind only when new vertices start triangle of their own
+  if(!_batchList.empty()) {
+    DrawBatch_t& last = _batchList.back();
+    if((last.triangleMode == triangleMode) && (last.cullBackFaces == cullBackFaces) &&
+       (continues || (last.count % groupSize == 0))) {
+      last.count += count;
+      return;
+    }
+  }
+
+  DrawBatch_t batch;
+  batch.first = _vertexList.size();
+  batch.count = count;
+  batch.triangleMode = triangleMode;
+  batch.cullBackFaces = cullBackFaces;
+  _batchList.push_back(batch);
 }
 
 void Engine::getFaceLightCoficient(Face_t& face, float& c)
@@ -331,87 +830,465 @@ void Engine::processLight(Face_t& face)
   face.c.color.b *= (_lightCoficient * a);
 }
 
-void Engine::processDrawing()
+void Engine::processDrawing(Frame_t& frame)
 {
+  memset(&frame.stats, 0, sizeof(frame.stats));
+
+  _drawFrame = &frame;
+  _colorPlane = frame.colorPlane;
+  _colorPitch = frame.colorPitch;
+
   //Draw nothing if render list is empty
-  if(_vertexList.empty())
+  if(frame.vertices.empty()) {
+    frame.batches.clear();
     return;
+  }
 
-  int size = _vertexList.size();
-
-  _vertices = size;
+  ProfileZone zone(cZoneProcessDrawing);
+  Uint64 start = getTimeNs();
 
   Face_t currFace;
+  const VertexStream& v = frame.vertices;
 
-  if(_triangleMode == TRIANGLE_NORMAL) {
+  _triangleList.clear();
 
-    //We draw only triangles!
-    if(size % 3 != 0) {
-      _vertexList.clear();
-      return;
+  DrawBatchList::const_iterator iter;
+  for(iter = frame.batches.begin(); iter != frame.batches.end(); ++iter) {
+    int end = iter->first + iter->count;
+    bool cull = iter->cullBackFaces;
+
+    if(iter->triangleMode == TRIANGLE_NORMAL) {
+
+      //We draw only complete triangles!
+      for(int i = iter->first; i + 2 < end; i += 3) {
+        v.get(i, currFace.a);
+        v.get(i + 1, currFace.b);
+        v.get(i + 2, currFace.c);
+        setupTriangle(currFace, cull);
+      }
+    } else if(iter->triangleMode == TRIANGLE_STRIP) {
+
+      //We draw only complete triangles!
+      for(int i = iter->first; i + 3 < end; i += 4) {
+        v.get(i, currFace.a);
+        v.get(i + 1, currFace.b);
+        v.get(i + 2, currFace.c);
+        setupTriangle(currFace, cull);
+
+        v.get(i + 1, currFace.a);
+        v.get(i + 2, currFace.b);
+        v.get(i + 3, currFace.c);
+        setupTriangle(currFace, cull, true);
+      }
     }
+  }
 
-    Vertex2_t v1, v2, v3;
+  frame.vertices.clear();
+  frame.batches.clear();
 
-    for(int i = 0; i < size; i += 3){
+  Uint64 setupEnd = getTimeNs();
+  frame.times.setup += setupEnd - start;
 
-      v1 = _vertexList.front();
-      _vertexList.pop_front();
+  binTriangles();
 
-      v2 = _vertexList.front();
-      _vertexList.pop_front();
+  Uint64 binEnd = getTimeNs();
+  frame.times.bin += binEnd - setupEnd;
 
-      v3 = _vertexList.front();
-      _vertexList.pop_front();
+  //Tiles never share pixels, so they are rasterized independently
+  {
+    ProfileZone rasterZone(cZoneRaster);
+    _rasterNode = Profiler::getInstance().currentNode();
+    _rasterPool->parallelFor(_rasterTileJob, this, _tilesX * _tilesY);
+  }
 
-      currFace.a = v1;
-      currFace.b = v2;
-      currFace.c = v3;
-      if(_enableLight)
-        processLight(currFace);
-      drawTriangle(currFace);
-      }
-    } else if(_triangleMode == TRIANGLE_STRIP) {
+  frame.times.raster += getTimeNs() - binEnd;
+}
 
-      //We draw only triangles!
-      if(size % 4 != 0) {
-        _vertexList.clear();
-        return;
-      }
+void Engine::setupClipPlanes()
+{
+  float p = _perspectiveRatio;
+  float w = static_cast<float>(_window.width);
+  float h = static_cast<float>(_window.height);
+  float g = cClipGuardBand;
+
+  //Projection is x * p / (p + z) and (h - y) * p / (p + z), so every plane
+  //of screen or guard band edge is linear in camera space
+  ClipPlane_t nearPlane = {0.0f, 0.0f, 1.0f, p - cNearPlane};
+  ClipPlane_t frustum[5] = {
+    nearPlane,
+    {p, 0.0f, 0.0f, 0.0f}, //left, sx >= 0
+    {-p, 0.0f, w, w * p}, //right, sx <= w
+    {0.0f, -p, 0.0f, h * p}, //top, sy >= 0
+    {0.0f, p, h, 0.0f} //bottom, sy <= h
+  };
+  ClipPlane_t guardBand[5] = {
+    nearPlane,
+    {p, 0.0f, g, g * p}, //sx >= -g
+    {-p, 0.0f, w + g, (w + g) * p}, //sx <= w + g
+    {0.0f, -p, g, (h + g) * p}, //sy >= -g
+    {0.0f, p, h + g, g * p} //sy <= h + g
+  };
+
+  for(int i = 0; i < 5; i++) {
+    _frustumPlanes[i] = frustum[i];
+    _clipPlanes[i] = guardBand[i];
+  }
+}
+
+/**
+* Signed distance of point to clip plane, scaled by plane normal length.
+*/
+static inline float planeDistance(const ClipPlane_t& plane, const Point3_t& p)
+{
+  return plane.a * p.x + plane.b * p.y + plane.c * p.z + plane.d;
+}
+
+void Engine::setupTriangle(Face_t& face, bool cullBackFaces, bool reversed)
+{
+  RenderStats_t& stats = _drawFrame->stats;
+  stats.submitted++;
+
+  if(cullBackFaces && (isBackFace(face) != reversed)) {
+    stats.backFacing++;
+    return;
+  }
+
+  if(outsideFrustum(face)) {
+    stats.outsideFrustum++;
+    return;
+  }
+
+  if(_drawFrame->enableLight)
+    processLight(face);
+
+  //Most triangles are whole inside of guard band and need no clipping
+  bool inside = true;
+  for(int i = 0; (i < 5) && inside; i++) {
+    inside = (planeDistance(_clipPlanes[i], face.a.point) >= 0.0f) &&
+             (planeDistance(_clipPlanes[i], face.b.point) >= 0.0f) &&
+             (planeDistance(_clipPlanes[i], face.c.point) >= 0.0f);
+  }
+
+  Triangle2_t tri;
+  if(inside) {
+    project(face.a, tri.a);
+    project(face.b, tri.b);
+    project(face.c, tri.c);
+    _triangleList.push_back(tri);
+    stats.drawn++;
+    return;
+  }
+
+  stats.clipped++;
+
+  Vertex2_t polygon[cMaxClipVertices];
+  int count = clipFace(face, polygon);
+
+  //Clipped polygon is convex, draw it as fan
+  for(int i = 1; i + 1 < count; i++) {
+    project(polygon[0], tri.a);
+    project(polygon[i], tri.b);
+    project(polygon[i + 1], tri.c);
+    _triangleList.push_back(tri);
+    stats.drawn++;
+  }
+}
+
+bool Engine::isBackFace(const Face_t& face) const
+{
+  const Point3_t& a = face.a.point;
+  const Point3_t& b = face.b.point;
+  const Point3_t& c = face.c.point;
+
+  //Projection center, every point on line through it lands on same pixel
+  float ex = 0.0f - a.x;
+  float ey = _window.height - a.y;
+  float ez = -_perspectiveRatio - a.z;
+
+  float x1 = b.x - a.x, y1 = b.y - a.y, z1 = b.z - a.z;
+  float x2 = c.x - a.x, y2 = c.y - a.y, z2 = c.z - a.z;
+
+  float nx = y1 * z2 - z1 * y2;
+  float ny = z1 * x2 - x1 * z2;
+  float nz = x1 * y2 - y1 * x2;
+
+  return (nx * ex + ny * ey + nz * ez) <= 0.0f;
+}
 
-    Vertex2_t v1, v2, v3, v4;
+bool Engine::outsideFrustum(const Face_t& face) const
+{
+  for(int i = 0; i < 5; i++) {
+    if((planeDistance(_frustumPlanes[i], face.a.point) < 0.0f) &&
+       (planeDistance(_frustumPlanes[i], face.b.point) < 0.0f) &&
+       (planeDistance(_frustumPlanes[i], face.c.point) < 0.0f))
+      return true;
+  }
+
+  return false;
+}
+
+/**
+* Interpolate vertex position and color.
+*/
+static void lerpVertex(const Vertex2_t& v1, const Vertex2_t& v2, float t, Vertex2_t& out)
+{
+  out.point.x = v1.point.x + (v2.point.x - v1.point.x) * t;
+  out.point.y = v1.point.y + (v2.point.y - v1.point.y) * t;
+  out.point.z = v1.point.z + (v2.point.z - v1.point.z) * t;
+  out.color.r = v1.color.r + (v2.color.r - v1.color.r) * t;
+  out.color.g = v1.color.g + (v2.color.g - v1.color.g) * t;
+  out.color.b = v1.color.b + (v2.color.b - v1.color.b) * t;
+  out.color.a = v1.color.a + (v2.color.a - v1.color.a) * t;
+}
+
+int Engine::clipFace(const Face_t& face, Vertex2_t* polygon) const
+{
+  //Sutherland-Hodgman, polygon is clipped by one plane after another
+  Vertex2_t buffer[2][cMaxClipVertices];
+  int current = 0;
+  int count = 3;
+  buffer[0][0] = face.a;
+  buffer[0][1] = face.b;
+  buffer[0][2] = face.c;
+
+  for(int i = 0; (i < 5) && (count > 0); i++) {
+    const Vertex2_t* in = buffer[current];
+    Vertex2_t* out = buffer[1 - current];
+
+    int outCount = 0;
+    for(int j = 0; j < count; j++) {
+      const Vertex2_t& v1 = in[j];
+      const Vertex2_t& v2 = in[(j + 1) % count];
+      float d1 = planeDistance(_clipPlanes[i], v1.point);
+      float d2 = planeDistance(_clipPlanes[i], v2.point);
+
+      if(d1 >= 0.0f)
+        out[outCount++] = v1;
+
+      //Edge crosses plane
+      if((d1 >= 0.0f) != (d2 >= 0.0f))
+        lerpVertex(v1, v2, d1 / (d1 - d2), out[outCount++]);
+    }
+    count = outCount;
+    current = 1 - current;
+  }
+
+  std::copy(buffer[current], buffer[current] + count, polygon);
+  return count;
+}
 
-    for(int i = 0; i < size; i += 4){
+void Engine::binTriangles()
+{
+  ProfileZone zone(cZoneBin);
 
-      v1 = _vertexList.front();
-      _vertexList.pop_front();
+  for(unsigned int i = 0; i < _tileBins.size(); i++)
+    _tileBins[i].clear();
 
-      v2 = _vertexList.front();
-      _vertexList.pop_front();
+  for(unsigned int i = 0; i < _triangleList.size(); i++) {
+    const Triangle2_t& tri = _triangleList[i];
 
-      v3 = _vertexList.front();
-      _vertexList.pop_front();
+    //Both filled and line triangles stay inside bounding box of their points
+    int minx = std::min(tri.a.x, std::min(tri.b.x, tri.c.x));
+    int maxx = std::max(tri.a.x, std::max(tri.b.x, tri.c.x));
+    int miny = std::min(tri.a.y, std::min(tri.b.y, tri.c.y));
+    int maxy = std::max(tri.a.y, std::max(tri.b.y, tri.c.y));
 
-      v4 = _vertexList.front();
-      _vertexList.pop_front();
+    int tx1 = std::max(minx, 0) / cTileSize;
+    int tx2 = std::min(maxx, _window.width - 1) / cTileSize;
+    int ty1 = std::max(miny, 0) / cTileSize;
+    int ty2 = std::min(maxy, _window.height - 1) / cTileSize;
 
-      currFace.a = v1;
-      currFace.b = v2;
-      currFace.c = v3;
-      if(_enableLight)
-        processLight(currFace);
-      drawTriangle(currFace);
+    for(int ty = ty1; ty <= ty2; ty++)
+      for(int tx = tx1; tx <= tx2; tx++)
+        _tileBins[ty * _tilesX + tx].push_back(i);
+  }
+}
+
+void Engine::getTileRect(int tile, ClipRect_t& rect) const
+{
+  rect.x1 = (tile % _tilesX) * cTileSize;
+  rect.y1 = (tile / _tilesX) * cTileSize;
+  rect.x2 = std::min(rect.x1 + cTileSize, _window.width) - 1;
+  rect.y2 = std::min(rect.y1 + cTileSize, _window.height) - 1;
+}
 
-      currFace.a = v2;
-      currFace.b = v3;
-      currFace.c = v4;
-      if(_enableLight)
-        processLight(currFace);
-      drawTriangle(currFace);
+/**
+* Fill row of pixels with one color.
+*/
+static void fillRow(Uint8* dst, Uint32 color, int count, int bytesPerPixel)
+{
+  switch(bytesPerPixel) {
+    case 4:
+      std::fill(reinterpret_cast<Uint32*>(dst), reinterpret_cast<Uint32*>(dst) + count, color);
+      break;
+    case 2:
+      std::fill(reinterpret_cast<Uint16*>(dst), reinterpret_cast<Uint16*>(dst) + count,
+                static_cast<Uint16>(color));
+      break;
+    case 1:
+      memset(dst, static_cast<Uint8>(color), count);
+      break;
+    case 3:
+      for(int i = 0; i < count; i++, dst += 3) {
+        #if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        dst[0] = (color >> 16) & 0xFF;
+        dst[1] = (color >> 8) & 0xFF;
+        dst[2] = color & 0xFF;
+        #else
+        dst[0] = color & 0xFF;
+        dst[1] = (color >> 8) & 0xFF;
+        dst[2] = (color >> 16) & 0xFF;
+        #endif
       }
+      break;
+  }
+}
+
+/**
+* Convert row of 32 bit mapped pixels to screen pixels.
+*/
+static void copyRow(Uint8* dst, const Uint32* src, int count, int bytesPerPixel)
+{
+  switch(bytesPerPixel) {
+    case 4:
+      memcpy(dst, src, count * sizeof(Uint32));
+      break;
+    case 2:
+      for(int i = 0; i < count; i++)
+        reinterpret_cast<Uint16*>(dst)[i] = static_cast<Uint16>(src[i]);
+      break;
+    case 1:
+      for(int i = 0; i < count; i++)
+        dst[i] = static_cast<Uint8>(src[i]);
+      break;
+    case 3:
+      for(int i = 0; i < count; i++)
+        fillRow(dst + i * 3, src[i], 1, 3);
+      break;
+  }
+}
+
+void Engine::resolveTileClear(int tile)
+{
+  std::vector<char>& tileClear = _drawFrame->tileClear;
+  if(!tileClear[tile])
+    return;
+
+  ClipRect_t rect;
+  getTileRect(tile, rect);
+
+  for(int y = rect.y1; y <= rect.y2; y++) {
+    float* depth = _depthPlane + y * _depthPitch;
+    std::fill(depth + rect.x1, depth + rect.x2 + 1, 0.0f);
+    fillRow(_colorPlane + y * _colorPitch + rect.x1 * _colorBytes, _clearColor,
+            rect.x2 - rect.x1 + 1, _colorBytes);
+  }
+
+  tileClear[tile] = 0;
+}
+
+void Engine::lockTarget()
+{
+  if(SDL_MUSTLOCK(_screen))
+    SDL_LockSurface(_screen);
+}
+
+void Engine::unlockTarget()
+{
+  if(SDL_MUSTLOCK(_screen))
+    SDL_UnlockSurface(_screen);
+}
+
+void Engine::presentTiles(const Frame_t& frame)
+{
+  Uint8* pixels = static_cast<Uint8*>(_screen->pixels);
+  int bytesPerPixel = _screen->format->BytesPerPixel;
+
+  ClipRect_t rect;
+  for(int tile = 0; tile < _tilesX * _tilesY; tile++) {
+    //Drawn tile already is on screen
+    if(_zeroCopy && !frame.tileClear[tile])
+      continue;
+
+    getTileRect(tile, rect);
+    int count = rect.x2 - rect.x1 + 1;
+
+    //Tile nobody has drawn to is presented as cleared without touching planes
+    for(int y = rect.y1; y <= rect.y2; y++) {
+      Uint8* dst = pixels + y * _screen->pitch + rect.x1 * bytesPerPixel;
+      const Uint8* src = frame.colorPlane + y * frame.colorPitch + rect.x1 * _colorBytes;
+      if(frame.tileClear[tile])
+        fillRow(dst, _clearColor, count, bytesPerPixel);
+      else if(_colorBytes == bytesPerPixel)
+        memcpy(dst, src, count * bytesPerPixel);
+      else
+        copyRow(dst, reinterpret_cast<const Uint32*>(src), count, bytesPerPixel);
     }
+  }
+}
+
+/**
+* Pick color plane of pixel format for screen.
+*/
+template<class Format>
+static bool usePixelFormat(const SDL_PixelFormat* format, JobFunc job, JobFunc& rasterTileJob,
+                           int& colorBytes)
+{
+  if(!Format::matches(format))
+    return false;
+
+  rasterTileJob = job;
+  colorBytes = sizeof(typename Format::Pixel);
+  return true;
+}
+
+void Engine::selectPixelFormat()
+{
+  const SDL_PixelFormat* format = _screen->format;
+
+  if(!usePixelFormat<PixelXRGB8888>(format, &Engine::rasterTileJob<PixelXRGB8888>, _rasterTileJob, _colorBytes) &&
+     !usePixelFormat<PixelXBGR8888>(format, &Engine::rasterTileJob<PixelXBGR8888>, _rasterTileJob, _colorBytes) &&
+     !usePixelFormat<PixelRGB565>(format, &Engine::rasterTileJob<PixelRGB565>, _rasterTileJob, _colorBytes) &&
+     !usePixelFormat<PixelRGB555>(format, &Engine::rasterTileJob<PixelRGB555>, _rasterTileJob, _colorBytes))
+    usePixelFormat<PixelMapped>(format, &Engine::rasterTileJob<PixelMapped>, _rasterTileJob, _colorBytes);
+
+  //Software screen storing pixels like color plane can be rasterized into directly
+  _canZeroCopy = (_colorBytes == format->BytesPerPixel) && !(_screen->flags & SDL_HWSURFACE);
+  _zeroCopy = false;
+  _colorPlane = 0;
+  _colorPitch = 0;
+}
+
+template<class Format>
+void Engine::rasterTileJob(void* engine, int tile)
+{
+  Engine* self = static_cast<Engine*>(engine);
+  const TileBin& bin = self->_tileBins[tile];
+
+  if(bin.empty())
+    return;
+
+  //Tiles done by workers are attributed to raster stage too
+  ProfileZone zone(cZoneRasterTile, self->_rasterNode);
+
+  //Tile is cleared by the thread drawing it, while it is in cache
+  self->resolveTileClear(tile);
+
+  //Tile rect limited to pixels accepted by pointInView
+  ClipRect_t clip;
+  self->getTileRect(tile, clip);
+  clip.x1 = std::max(clip.x1, 1);
+  clip.y1 = std::max(clip.y1, 1);
 
-  _vertexList.clear();
+  const Frame_t* frame = self->_drawFrame;
+  bool halfSpace = (frame->rasterizer == RASTER_HALFSPACE) && (frame->renderMode == RENDER_FILLED);
+
+  for(unsigned int i = 0; i < bin.size(); i++) {
+    if(halfSpace)
+      self->drawTriangleHalfSpace<Format>(self->_triangleList[bin[i]], clip);
+    else
+      self->drawTriangle<Format>(self->_triangleList[bin[i]], clip);
+  }
 }
 
 void Engine::handleInput(SDL_Event& event, int& buttonIndicator)
@@ -439,7 +1316,7 @@ void Engine::handleInput(SDL_Event& event, int& buttonIndicator)
     #ifdef _DEBUG
     else if(button == 4) {
 
-      _pfManager.getInstance().print();
+      Profiler::getInstance().print();
     }
     #endif
 
@@ -455,6 +1332,12 @@ void Engine::handleInput(SDL_Event& event, int& buttonIndicator)
       if(event.key.keysym.sym == SDLK_l) {
         _enableLight = !_enableLight;
       }
+      if(event.key.keysym.sym == SDLK_r) {
+        (_rasterizer == RASTER_SCANLINE) ? _rasterizer = RASTER_HALFSPACE : _rasterizer = RASTER_SCANLINE;
+      }
+      if(event.key.keysym.sym == SDLK_p) {
+        Profiler::getInstance().setEnabled(!Profiler::isEnabled());
+      }
     }
   }
 }
@@ -474,8 +1357,115 @@ void Engine::setRenderMode(int mode)
     _renderMode = RENDER_LINES;
 }
 
+void Engine::setRasterThreads(int threads)
+{
+  if(threads < 1)
+    threads = 1;
+
+  //Pool may be drawing frame in flight
+  finishFrames(true);
+
+  if(_rasterPool) {
+    if(_rasterPool->size() == threads)
+      return;
+    delete _rasterPool;
+  }
+
+  _rasterPool = new ThreadPool(threads);
+}
+
+int Engine::getRasterThreads() const
+{
+  return _rasterPool->size();
+}
+
+void Engine::setRasterizer(int rasterizer)
+{
+  if(rasterizer == RASTER_HALFSPACE)
+    _rasterizer = RASTER_HALFSPACE;
+  else
+    _rasterizer = RASTER_SCANLINE;
+}
+
+int Engine::getRasterizer() const
+{
+  return _rasterizer;
+}
+
+void Engine::setPixelKernel(int kernel)
+{
+  if((kernel == PIXELS_AVX2) && !cpuSupports(CPU_AVX2))
+    kernel = PIXELS_SSE2;
+  if((kernel == PIXELS_SSE2) && !cpuSupports(CPU_SSE2))
+    kernel = PIXELS_SCALAR;
+
+  if((kernel == PIXELS_SSE2) || (kernel == PIXELS_AVX2))
+    _pixelKernel = kernel;
+  else
+    _pixelKernel = PIXELS_SCALAR;
+}
+
+int Engine::getPixelKernel() const
+{
+  return _pixelKernel;
+}
+
+void Engine::setFramePacing(int pacing, int frameRate)
+{
+  if((pacing == PACING_TARGET) || (pacing == PACING_IDLE))
+    _pacing = pacing;
+  else
+    _pacing = PACING_UNCAPPED;
+
+  if(frameRate > 0)
+    _frameBudget = 1000000000ULL / frameRate;
+}
+
+int Engine::getFramePacing() const
+{
+  return _pacing;
+}
+
+void Engine::paceFrame()
+{
+  Uint64 now = getTimeNs();
+  if(_pacing == PACING_UNCAPPED) {
+    _frameDeadline = now;
+    return;
+  }
+
+  //Frames are due one budget apart, so sleep overshoot does not add up;
+  //late frame starts schedule again instead of catching up
+  Uint64 budget = (_pacing == PACING_IDLE) ? 1000000000ULL / cIdleFrameRate : _frameBudget;
+  _frameDeadline += budget;
+  if(_frameDeadline <= now) {
+    _frameDeadline = now;
+    return;
+  }
+
+  ProfileZone zone(cZonePacing);
+  sleepUntilNs(_frameDeadline);
+  _lastTimes.pacing = getTimeNs() - now;
+}
+
+const RenderStats_t& Engine::getRenderStats() const
+{
+  return _lastStats;
+}
+
+const FrameTimes_t& Engine::getFrameTimes() const
+{
+  return _lastTimes;
+}
+
+void Engine::setState(int state)
+{
+  _engineState = (state == GAME_STATE) ? GAME_STATE : MAIN_MENU_STATE;
+}
+
 void Engine::setTriangleMode(int mode)
 {
+  flushVertices();
   if(mode == TRIANGLE_NORMAL)
     _triangleMode = TRIANGLE_NORMAL;
   else if(mode == TRIANGLE_STRIP)
@@ -488,8 +1478,11 @@ void Engine::project(const Vertex2_t& p3d, Point2_t& p2d) const
 {
   float scale = _perspectiveRatio / (_perspectiveRatio + p3d.point.z);
 
-  p2d.x = static_cast<Sint16>(p3d.point.x * scale);
-  p2d.y = static_cast<Sint16>((_window.height - p3d.point.y) * scale);
+  p2d.sx = p3d.point.x * scale;
+  p2d.sy = (_window.height - p3d.point.y) * scale;
+
+  p2d.x = static_cast<Sint16>(p2d.sx);
+  p2d.y = static_cast<Sint16>(p2d.sy);
 
   p2d.z = 1.0 / (_perspectiveRatio + p3d.point.z);
 
@@ -497,18 +1490,12 @@ void Engine::project(const Vertex2_t& p3d, Point2_t& p2d) const
 
 }
 
-void Engine::drawTriangle(Face_t& face)
+template<class Format>
+void Engine::drawTriangle(const Triangle2_t& tri, const ClipRect_t& clip)
 {
-  //project points
-  Point2_t A, B, C;
-  project(face.a, A);
-  project(face.b, B);
-  project(face.c, C);
-
-  if(triangleInView(A, B, C) == false)
-    return;
+  Point2_t A = tri.a, B = tri.b, C = tri.c;
 
-  if(_renderMode == RENDER_FILLED) {
+  if(_drawFrame->renderMode == RENDER_FILLED) {
     //Sort points by y
     if(A.y > B.y) {
       swap<Point2_t>(A, B);
@@ -553,12 +1540,17 @@ void Engine::drawTriangle(Face_t& face)
     dg3 = (B.color.g - A.color.g) / dy3;
     db3 = (B.color.b - A.color.b) / dy3;
 
-    Sint16 y, x1, x2;
+    Sint16 x1, x2;
     float z1, z2;
 
     Color4_t col1, col2;
 
-    for(y = A.y; y <= C.y; y++) {
+    //Every scanline is computed from triangle points only, so clipped
+    //scanlines are the same as unclipped ones
+    int ystart = std::max(static_cast<int>(A.y), clip.y1);
+    int yend = std::min(static_cast<int>(C.y), clip.y2);
+
+    for(int y = ystart; y <= yend; y++) {
       x1 = A.x + dx1 * (y - A.y) / dy1;
 
       /* Start of float operations, must be optimized somehow. */
@@ -597,20 +1589,440 @@ void Engine::drawTriangle(Face_t& face)
         swap<float>(z1, z2);
         swap<Color4_t>(col1, col2);
       }
-      drawHorizLine(x1, x2, y, col1, col2, z1, z2);
+      drawHorizLine<Format>(x1, x2, y, col1, col2, z1, z2, clip);
     }
-  } else if(_renderMode == RENDER_LINES) {
-    drawLine(A.x, A.y, B.x, B.y, A.color);
-    drawLine(B.x, B.y, C.x, C.y, B.color);
-    drawLine(C.x, C.y, A.x, A.y, C.color);
+  } else if(_drawFrame->renderMode == RENDER_LINES) {
+    drawLine<Format>(A.x, A.y, B.x, B.y, A.color, clip);
+    drawLine<Format>(B.x, B.y, C.x, C.y, B.color, clip);
+    drawLine<Format>(C.x, C.y, A.x, A.y, C.color, clip);
   }
 }
 
-void Engine::drawHorizLine(Sint16 x1, Sint16 x2, Sint16 y, Color4_t color1, Color4_t color2,
-                           float z1, float z2)
+/**
+* Set up plane equation of attribute over triangle.
+* @param a0/a1/a2 Attribute at triangle points.
+* @param x10/y10/x20/y20 Edges from first point.
+* @param det Doubled triangle area.
+* @param cx/cy Offset of first pixel center from first point.
+* @param a Attribute at first pixel center.
+* @param dadx/dady Attribute steps.
+*/
+static void setupPlane(float a0, float a1, float a2, float x10, float y10, float x20, float y20,
+                       float det, float cx, float cy, float& a, float& dadx, float& dady)
+{
+  dadx = ((a1 - a0) * y20 - (a2 - a0) * y10) / det;
+  dady = ((a2 - a0) * x10 - (a1 - a0) * x20) / det;
+  a = a0 + dadx * cx + dady * cy;
+}
+
+/**
+* Clamp color component to [0, 1].
+*/
+static inline float clampColor(float c)
 {
-  Sint16 i;
+  return (c < 0.0f) ? 0.0f : ((c > 1.0f) ? 1.0f : c);
+}
+
+template<class Format>
+void Engine::drawTriangleHalfSpace(const Triangle2_t& tri, const ClipRect_t& clip)
+{
+  //Points far off screen would overflow fixed point edge functions
+  if((fabs(tri.a.sx) > cGuardBand) || (fabs(tri.a.sy) > cGuardBand) ||
+     (fabs(tri.b.sx) > cGuardBand) || (fabs(tri.b.sy) > cGuardBand) ||
+     (fabs(tri.c.sx) > cGuardBand) || (fabs(tri.c.sy) > cGuardBand)) {
+    drawTriangle<Format>(tri, clip);
+    return;
+  }
+
+  HalfSpace_t hs;
+  if(!setupHalfSpace(tri, clip, hs))
+    return;
+
+  if(_pixelKernel == PIXELS_AVX2)
+    rasterHalfSpaceAVX2<Format>(hs);
+  else if(_pixelKernel == PIXELS_SSE2)
+    rasterHalfSpaceSSE2<Format>(hs);
+  else
+    rasterHalfSpaceScalar<Format>(hs);
+}
+
+bool Engine::setupHalfSpace(const Triangle2_t& tri, const ClipRect_t& clip, HalfSpace_t& hs)
+{
+  const Point2_t* p[3] = {&tri.a, &tri.b, &tri.c};
+
+  //Snap points to sub pixel grid
+  int X[3], Y[3];
+  for(int i = 0; i < 3; i++) {
+    X[i] = static_cast<int>(floor(p[i]->sx * cSubPixel + 0.5f));
+    Y[i] = static_cast<int>(floor(p[i]->sy * cSubPixel + 0.5f));
+  }
+
+  //Edge functions are positive inside if area is positive, so fix winding
+  Sint64 area = static_cast<Sint64>(X[1] - X[0]) * (Y[2] - Y[0]) -
+                static_cast<Sint64>(Y[1] - Y[0]) * (X[2] - X[0]);
+  if(area == 0)
+    return false;
+
+  if(area < 0) {
+    swap<int>(X[1], X[2]);
+    swap<int>(Y[1], Y[2]);
+    swap<const Point2_t*>(p[1], p[2]);
+  }
+
+  //Pixels whose centers may be covered, pixel x has center at x + 0.5
+  int half = cSubPixel / 2;
+  hs.x1 = (std::min(X[0], std::min(X[1], X[2])) - half + cSubPixel - 1) >> cSubPixelBits;
+  hs.y1 = (std::min(Y[0], std::min(Y[1], Y[2])) - half + cSubPixel - 1) >> cSubPixelBits;
+  hs.x2 = (std::max(X[0], std::max(X[1], X[2])) - half) >> cSubPixelBits;
+  hs.y2 = (std::max(Y[0], std::max(Y[1], Y[2])) - half) >> cSubPixelBits;
+
+  hs.x1 = std::max(hs.x1, clip.x1);
+  hs.y1 = std::max(hs.y1, clip.y1);
+  hs.x2 = std::min(hs.x2, clip.x2);
+  hs.y2 = std::min(hs.y2, clip.y2);
+
+  if((hs.x1 > hs.x2) || (hs.y1 > hs.y2))
+    return false;
+
+  int px = (hs.x1 << cSubPixelBits) + half;
+  int py = (hs.y1 << cSubPixelBits) + half;
+
+  for(int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    int dx = X[j] - X[i];
+    int dy = Y[j] - Y[i];
+
+    Sint64 e = static_cast<Sint64>(dx) * (py - Y[i]) - static_cast<Sint64>(dy) * (px - X[i]);
+
+    //Top left fill rule, pixels exactly on other edges are not drawn
+    bool topLeft = (dy < 0) || ((dy == 0) && (dx > 0));
+    if(!topLeft)
+      e -= 1;
+
+    //Inside one tile edge changes less than cEdgeClamp, so clamped value
+    //keeps its sign and int can not overflow
+    if(e > cEdgeClamp)
+      e = cEdgeClamp;
+    else if(e < -cEdgeClamp)
+      e = -cEdgeClamp;
+
+    hs.e[i] = static_cast<int>(e);
+    hs.edx[i] = -dy * cSubPixel;
+    hs.edy[i] = dx * cSubPixel;
+  }
+
+  //Attributes are interpolated linearly in screen space, like scanline does
+  float fx0 = static_cast<float>(X[0]) / cSubPixel, fy0 = static_cast<float>(Y[0]) / cSubPixel;
+  float x10 = static_cast<float>(X[1] - X[0]) / cSubPixel, y10 = static_cast<float>(Y[1] - Y[0]) / cSubPixel;
+  float x20 = static_cast<float>(X[2] - X[0]) / cSubPixel, y20 = static_cast<float>(Y[2] - Y[0]) / cSubPixel;
+  float det = x10 * y20 - x20 * y10;
+  float cx = hs.x1 + 0.5f - fx0;
+  float cy = hs.y1 + 0.5f - fy0;
+
+  setupPlane(p[0]->z, p[1]->z, p[2]->z, x10, y10, x20, y20, det, cx, cy, hs.z, hs.dzdx, hs.dzdy);
+  setupPlane(p[0]->color.r, p[1]->color.r, p[2]->color.r, x10, y10, x20, y20, det, cx, cy, hs.r, hs.drdx, hs.drdy);
+  setupPlane(p[0]->color.g, p[1]->color.g, p[2]->color.g, x10, y10, x20, y20, det, cx, cy, hs.g, hs.dgdx, hs.dgdy);
+  setupPlane(p[0]->color.b, p[1]->color.b, p[2]->color.b, x10, y10, x20, y20, det, cx, cy, hs.b, hs.dbdx, hs.dbdy);
+
+  return true;
+}
+
+template<class Format>
+void Engine::rasterHalfSpaceScalar(const HalfSpace_t& hs)
+{
+  int e0 = hs.e[0], e1 = hs.e[1], e2 = hs.e[2];
+  float z = hs.z, r = hs.r, g = hs.g, b = hs.b;
+
+  Color4_t color;
+  color.a = 1.0f;
+
+  for(int y = hs.y1; y <= hs.y2; y++) {
+    int w0 = e0, w1 = e1, w2 = e2;
+
+    for(int x = hs.x1; x <= hs.x2; x++) {
+      //Inside if no edge value is negative
+      if((w0 | w1 | w2) >= 0) {
+        //Attributes are evaluated from row start like pixel blocks do it
+        float i = static_cast<float>(x - hs.x1);
+        color.r = clampColor(r + i * hs.drdx);
+        color.g = clampColor(g + i * hs.dgdx);
+        color.b = clampColor(b + i * hs.dbdx);
+        putPixel<Format>(x, y, color, z + i * hs.dzdx);
+      }
+
+      w0 += hs.edx[0];
+      w1 += hs.edx[1];
+      w2 += hs.edx[2];
+    }
+
+    e0 += hs.edy[0];
+    e1 += hs.edy[1];
+    e2 += hs.edy[2];
+    z += hs.dzdy;
+    r += hs.drdy;
+    g += hs.dgdy;
+    b += hs.dbdy;
+  }
+}
 
+#ifdef CPU_X86
+/**
+* Clamp 4 color components to [0, 1] and scale them to 0-255 like putPixel,
+* in double so truncation is the same.
+*/
+TARGET_SSE2
+static inline __m128i toComponents4(__m128 c)
+{
+  c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  __m128d scale = _mm_set1_pd(255.0);
+  __m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(c), scale));
+  __m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(c, c)), scale));
+  return _mm_unpacklo_epi64(lo, hi);
+}
+
+/**
+* Clamp and scale 8 color components, see toComponents4.
+*/
+TARGET_AVX2
+static inline __m256i toComponents8(__m256 c)
+{
+  c = _mm256_min_ps(_mm256_max_ps(c, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+  __m256d scale = _mm256_set1_pd(255.0);
+  __m128i lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(c)), scale));
+  __m128i hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(c, 1)), scale));
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+template<class Format>
+TARGET_SSE2
+void Engine::rasterHalfSpaceSSE2(const HalfSpace_t& hs)
+{
+  typedef typename Format::Pixel Pixel;
+
+  //Blocks start at multiple of 4, so they never cross tile and pixels of
+  //block outside triangle belong to this thread, they are written back unchanged
+  int bx1 = hs.x1 & ~3;
+  int skip = hs.x1 - bx1;
+
+  //Edge values of block lanes x, x + 1, x + 2, x + 3
+  __m128i off0 = _mm_set_epi32((3 - skip) * hs.edx[0], (2 - skip) * hs.edx[0], (1 - skip) * hs.edx[0], -skip * hs.edx[0]);
+  __m128i off1 = _mm_set_epi32((3 - skip) * hs.edx[1], (2 - skip) * hs.edx[1], (1 - skip) * hs.edx[1], -skip * hs.edx[1]);
+  __m128i off2 = _mm_set_epi32((3 - skip) * hs.edx[2], (2 - skip) * hs.edx[2], (1 - skip) * hs.edx[2], -skip * hs.edx[2]);
+  __m128i step0 = _mm_set1_epi32(4 * hs.edx[0]);
+  __m128i step1 = _mm_set1_epi32(4 * hs.edx[1]);
+  __m128i step2 = _mm_set1_epi32(4 * hs.edx[2]);
+
+  __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+  __m128i first = _mm_set1_epi32(hs.x1);
+  __m128i last = _mm_set1_epi32(hs.x2);
+  __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+  __m128 dzdx = _mm_set1_ps(hs.dzdx);
+  __m128 drdx = _mm_set1_ps(hs.drdx);
+  __m128 dgdx = _mm_set1_ps(hs.dgdx);
+  __m128 dbdx = _mm_set1_ps(hs.dbdx);
+
+  int e0 = hs.e[0], e1 = hs.e[1], e2 = hs.e[2];
+  float z = hs.z, r = hs.r, g = hs.g, b = hs.b;
+
+  float zs[4];
+  Uint32 ps[4];
+
+  for(int y = hs.y1; y <= hs.y2; y++) {
+    __m128i w0 = _mm_add_epi32(_mm_set1_epi32(e0), off0);
+    __m128i w1 = _mm_add_epi32(_mm_set1_epi32(e1), off1);
+    __m128i w2 = _mm_add_epi32(_mm_set1_epi32(e2), off2);
+    __m128 pz = _mm_set1_ps(z), pr = _mm_set1_ps(r), pg = _mm_set1_ps(g), pb = _mm_set1_ps(b);
+
+    float* depthRow = _depthPlane + y * _depthPitch;
+    Pixel* colorRow = reinterpret_cast<Pixel*>(_colorPlane + y * _colorPitch);
+
+    for(int x = bx1; x <= hs.x2; x += 4) {
+      //Sign bit of any edge set or lane outside bounding box means pixel is outside
+      __m128i xs = _mm_add_epi32(_mm_set1_epi32(x), lane);
+      __m128i outside = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(w0, w1), w2), 31);
+      outside = _mm_or_si128(outside, _mm_or_si128(_mm_cmplt_epi32(xs, first), _mm_cmpgt_epi32(xs, last)));
+
+      w0 = _mm_add_epi32(w0, step0);
+      w1 = _mm_add_epi32(w1, step1);
+      w2 = _mm_add_epi32(w2, step2);
+
+      if(_mm_movemask_ps(_mm_castsi128_ps(outside)) == 0xF)
+        continue;
+
+      //Same depth test as putPixel, pixel is drawn unless stored depth is greater
+      __m128 i = _mm_cvtepi32_ps(_mm_sub_epi32(xs, first));
+      __m128 depth = _mm_loadu_ps(depthRow + x);
+      __m128 newDepth = _mm_add_ps(pz, _mm_mul_ps(i, dzdx));
+      __m128 draw = _mm_andnot_ps(_mm_or_ps(_mm_castsi128_ps(outside), _mm_cmpgt_ps(depth, newDepth)), all);
+      int mask = _mm_movemask_ps(draw);
+      if(!mask)
+        continue;
+
+      __m128i pixels = Format::pack4(_screen->format,
+                                     toComponents4(_mm_add_ps(pr, _mm_mul_ps(i, drdx))),
+                                     toComponents4(_mm_add_ps(pg, _mm_mul_ps(i, dgdx))),
+                                     toComponents4(_mm_add_ps(pb, _mm_mul_ps(i, dbdx))));
+
+      //Block at right screen edge would touch pixels past end of color row
+      if(x + 3 >= _window.width) {
+        _mm_storeu_ps(zs, newDepth);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(ps), pixels);
+        for(int k = 0; k < 4; k++) {
+          if(mask & (1 << k)) {
+            depthRow[x + k] = zs[k];
+            colorRow[x + k] = static_cast<Pixel>(ps[k]);
+          }
+        }
+        continue;
+      }
+
+      _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(draw, newDepth), _mm_andnot_ps(draw, depth)));
+
+      __m128i drawi = _mm_castps_si128(draw);
+      if(sizeof(Pixel) == 4) {
+        __m128i* dst = reinterpret_cast<__m128i*>(colorRow + x);
+        __m128i old = _mm_loadu_si128(dst);
+        _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(drawi, pixels), _mm_andnot_si128(drawi, old)));
+      } else {
+        //Narrow 32 bit lanes to 16 bit, sign extension keeps pack from saturating
+        pixels = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(pixels, 16), 16), pixels);
+        drawi = _mm_packs_epi32(drawi, drawi);
+        __m128i* dst = reinterpret_cast<__m128i*>(colorRow + x);
+        __m128i old = _mm_loadl_epi64(dst);
+        _mm_storel_epi64(dst, _mm_or_si128(_mm_and_si128(drawi, pixels), _mm_andnot_si128(drawi, old)));
+      }
+    }
+
+    e0 += hs.edy[0];
+    e1 += hs.edy[1];
+    e2 += hs.edy[2];
+    z += hs.dzdy;
+    r += hs.drdy;
+    g += hs.dgdy;
+    b += hs.dbdy;
+  }
+}
+
+template<class Format>
+TARGET_AVX2
+void Engine::rasterHalfSpaceAVX2(const HalfSpace_t& hs)
+{
+  typedef typename Format::Pixel Pixel;
+
+  //Blocks of 8 aligned like in rasterHalfSpaceSSE2, tile width is multiple of 8
+  int bx1 = hs.x1 & ~7;
+  int skip = hs.x1 - bx1;
+
+  __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  __m256i index = _mm256_sub_epi32(lane, _mm256_set1_epi32(skip));
+  __m256i off0 = _mm256_mullo_epi32(index, _mm256_set1_epi32(hs.edx[0]));
+  __m256i off1 = _mm256_mullo_epi32(index, _mm256_set1_epi32(hs.edx[1]));
+  __m256i off2 = _mm256_mullo_epi32(index, _mm256_set1_epi32(hs.edx[2]));
+  __m256i step0 = _mm256_set1_epi32(8 * hs.edx[0]);
+  __m256i step1 = _mm256_set1_epi32(8 * hs.edx[1]);
+  __m256i step2 = _mm256_set1_epi32(8 * hs.edx[2]);
+
+  __m256i first = _mm256_set1_epi32(hs.x1);
+  __m256i last = _mm256_set1_epi32(hs.x2);
+  __m256 dzdx = _mm256_set1_ps(hs.dzdx);
+  __m256 drdx = _mm256_set1_ps(hs.drdx);
+  __m256 dgdx = _mm256_set1_ps(hs.dgdx);
+  __m256 dbdx = _mm256_set1_ps(hs.dbdx);
+
+  int e0 = hs.e[0], e1 = hs.e[1], e2 = hs.e[2];
+  float z = hs.z, r = hs.r, g = hs.g, b = hs.b;
+
+  float zs[8];
+  Uint32 ps[8];
+
+  for(int y = hs.y1; y <= hs.y2; y++) {
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(e0), off0);
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(e1), off1);
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(e2), off2);
+    __m256 pz = _mm256_set1_ps(z), pr = _mm256_set1_ps(r), pg = _mm256_set1_ps(g), pb = _mm256_set1_ps(b);
+
+    float* depthRow = _depthPlane + y * _depthPitch;
+    Pixel* colorRow = reinterpret_cast<Pixel*>(_colorPlane + y * _colorPitch);
+
+    for(int x = bx1; x <= hs.x2; x += 8) {
+      __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x), lane);
+      __m256i outside = _mm256_srai_epi32(_mm256_or_si256(_mm256_or_si256(w0, w1), w2), 31);
+      outside = _mm256_or_si256(outside, _mm256_or_si256(_mm256_cmpgt_epi32(first, xs), _mm256_cmpgt_epi32(xs, last)));
+
+      w0 = _mm256_add_epi32(w0, step0);
+      w1 = _mm256_add_epi32(w1, step1);
+      w2 = _mm256_add_epi32(w2, step2);
+
+      if(_mm256_movemask_ps(_mm256_castsi256_ps(outside)) == 0xFF)
+        continue;
+
+      __m256 i = _mm256_cvtepi32_ps(_mm256_sub_epi32(xs, first));
+      __m256 depth = _mm256_loadu_ps(depthRow + x);
+      __m256 newDepth = _mm256_add_ps(pz, _mm256_mul_ps(i, dzdx));
+      __m256 reject = _mm256_or_ps(_mm256_castsi256_ps(outside), _mm256_cmp_ps(depth, newDepth, _CMP_GT_OQ));
+      int mask = ~_mm256_movemask_ps(reject) & 0xFF;
+      if(!mask)
+        continue;
+
+      __m256i pixels = Format::pack8(_screen->format,
+                                     toComponents8(_mm256_add_ps(pr, _mm256_mul_ps(i, drdx))),
+                                     toComponents8(_mm256_add_ps(pg, _mm256_mul_ps(i, dgdx))),
+                                     toComponents8(_mm256_add_ps(pb, _mm256_mul_ps(i, dbdx))));
+
+      if(x + 7 >= _window.width) {
+        _mm256_storeu_ps(zs, newDepth);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(ps), pixels);
+        for(int k = 0; k < 8; k++) {
+          if(mask & (1 << k)) {
+            depthRow[x + k] = zs[k];
+            colorRow[x + k] = static_cast<Pixel>(ps[k]);
+          }
+        }
+        continue;
+      }
+
+      _mm256_storeu_ps(depthRow + x, _mm256_blendv_ps(newDepth, depth, reject));
+
+      __m256i rejecti = _mm256_castps_si256(reject);
+      if(sizeof(Pixel) == 4) {
+        __m256i* dst = reinterpret_cast<__m256i*>(colorRow + x);
+        _mm256_storeu_si256(dst, _mm256_blendv_epi8(pixels, _mm256_loadu_si256(dst), rejecti));
+      } else {
+        //Pack works within 128 bit halves, permute brings both halves to low one
+        __m128i narrow = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(pixels, pixels), 0x08));
+        __m128i keep = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packs_epi32(rejecti, rejecti), 0x08));
+        __m128i* dst = reinterpret_cast<__m128i*>(colorRow + x);
+        _mm_storeu_si128(dst, _mm_blendv_epi8(narrow, _mm_loadu_si128(dst), keep));
+      }
+    }
+
+    e0 += hs.edy[0];
+    e1 += hs.edy[1];
+    e2 += hs.edy[2];
+    z += hs.dzdy;
+    r += hs.drdy;
+    g += hs.dgdy;
+    b += hs.dbdy;
+  }
+}
+#else
+template<class Format>
+void Engine::rasterHalfSpaceSSE2(const HalfSpace_t& hs)
+{
+  rasterHalfSpaceScalar<Format>(hs);
+}
+
+template<class Format>
+void Engine::rasterHalfSpaceAVX2(const HalfSpace_t& hs)
+{
+  rasterHalfSpaceScalar<Format>(hs);
+}
+#endif
+
+template<class Format>
+void Engine::drawHorizLine(Sint16 x1, Sint16 x2, Sint16 y, Color4_t color1, Color4_t color2,
+                           float z1, float z2, const ClipRect_t& clip)
+{
   Sint16 dx;
   float dz;
 
@@ -625,7 +2037,10 @@ void Engine::drawHorizLine(Sint16 x1, Sint16 x2, Sint16 y, Color4_t color1, Colo
   float z;
   Color4_t finalColor;
 
-  for(i = x1; i <= x2; i++) {
+  int xstart = std::max(static_cast<int>(x1), clip.x1);
+  int xend = std::min(static_cast<int>(x2), clip.x2);
+
+  for(int i = xstart; i <= xend; i++) {
     /* Start of float operations, must be optimized somehow. */
     z = z1 + dz * (i - x1) / dx;
 
@@ -634,11 +2049,13 @@ void Engine::drawHorizLine(Sint16 x1, Sint16 x2, Sint16 y, Color4_t color1, Colo
     finalColor.b = color1.b + db * (i - x1);
     /* end of float operations. */
 
-    putPixel(i, y, finalColor, z);
+    putPixel<Format>(i, y, finalColor, z);
   }
 }
 
-void Engine::drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color)
+template<class Format>
+void Engine::drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color,
+                      const ClipRect_t& clip)
 {
   Sint16 dx = abs(x2 - x1);
   Sint16 dy = abs(y2 - y1);
@@ -673,7 +2090,8 @@ void Engine::drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color
   }
 
   for(Sint16 px = 0; px <= numpixels; px++) {
-    putPixel(x, y, color);
+    if((x >= clip.x1) && (x <= clip.x2) && (y >= clip.y1) && (y <= clip.y2))
+      putPixel<Format>(x, y, color);
 
     num += numadd;
     if(num >= den) {
@@ -686,33 +2104,38 @@ void Engine::drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color
   }
 }
 
+template<class Format>
 void Engine::putPixel(Sint16 x, Sint16 y, Color4_t color, float z)
 {
+  if(!pointInView(x, y))
+    return;
+
+  float& depth = _depthPlane[y * _depthPitch + x];
+  if(depth > z)
+    return;
+
+  depth = z;
+
   Uint8 r = static_cast<Uint8>(color.r * 255.0);
   Uint8 g = static_cast<Uint8>(color.g * 255.0);
   Uint8 b = static_cast<Uint8>(color.b * 255.0);
 
-  Uint32 cl = SDL_MapRGB(_screen->format, r, g, b);
-
-  if(pointInView(x, y)) {
-    if(_zbuffer[x][y].z <= z) {
-      _zbuffer[x][y].z = z;
-      _zbuffer[x][y].color = cl;
-    }
-  }
+  typename Format::Pixel* row = reinterpret_cast<typename Format::Pixel*>(_colorPlane + y * _colorPitch);
+  row[x] = Format::pack(_screen->format, r, g, b);
 }
 
+template<class Format>
 void Engine::putPixel(Sint16 x, Sint16 y, Color4_t color)
 {
+  if(!pointInView(x, y))
+    return;
+
   Uint8 r = static_cast<Uint8>(color.r * 255.0);
   Uint8 g = static_cast<Uint8>(color.g * 255.0);
   Uint8 b = static_cast<Uint8>(color.b * 255.0);
 
-  Uint32 cl = SDL_MapRGB(_screen->format, r, g, b);
-
-  if(pointInView(x, y)) {
-    _zbuffer[x][y].color = cl;
-  }
+  typename Format::Pixel* row = reinterpret_cast<typename Format::Pixel*>(_colorPlane + y * _colorPitch);
+  row[x] = Format::pack(_screen->format, r, g, b);
 }
 
 bool Engine::pointInView(Sint16 x, Sint16 y) const
@@ -720,7 +2143,3 @@ bool Engine::pointInView(Sint16 x, Sint16 y) const
   return ((x > 0) && (x < _window.width) && (y > 0) && (y < _window.height));
 }
 
-bool Engine::triangleInView(Point2_t& p1, Point2_t& p2, Point2_t& p3) const
-{
-  return (pointInView(p1.x, p1.y) || pointInView(p2.x, p2.y) || pointInView(p3.x, p3.y));
-}
@@ -8,54 +8,94 @@
 #ifndef ENGINE_HPP_INCLUDED
 #define ENGINE_HPP_INCLUDED
 
-#include <list>
+#include <vector>
 
 #include <SDL/SDL_ttf.h>
 
 #include "../Math/Matrix.hpp"
 #include "../Math/Vector.hpp"
 #include "../gui/MainMenu.hpp"
+#include "Types.hpp"
+#include "VertexStream.hpp"
+#include "Backend.hpp"
+#include "../utils/ThreadPool.hpp"
 
-#ifdef _DEBUG
-#include "../utils/Profiler.hpp"
-#endif
-
-//3d Point
+//Draw batch, run of vertices sharing one triangle mode and culling
 typedef struct{
-  float x, y, z;
-}Point3_t;
+  int first, count;
+  int triangleMode;
+  bool cullBackFaces;
+}DrawBatch_t;
 
-//Color with 4 components (+alpha)
-typedef struct{
-  float r, g, b, a;
-}Color4_t;
+//Vertex list
+typedef std::vector<Vertex2_t> Vertex2List;
 
-//point
-typedef struct{
-  Sint16 x, y;
-  Color4_t color;
-  float z;
-}Point2_t;
+//Draw batch list
+typedef std::vector<DrawBatch_t> DrawBatchList;
 
-//Vertex
+//Copy of mesh, object space point p is drawn at offset + scale * p
 typedef struct{
-  Point3_t point;
-  Color4_t color;
-}Vertex2_t;
+  float x, y, z; //offset
+  float scale; //uniform scale, positive so faces keep their winding
+}Instance_t;
 
-//Face
-typedef struct{
-  Vertex2_t a, b, c;
-}Face_t;
+//Instance list
+typedef std::vector<Instance_t> InstanceList;
 
-//Zbufer
+//Mesh, vertices kept resident in object space
 typedef struct{
-  float z;
-  Uint32 color;
-}ZBuffer_t;
+  VertexStream vertices;
+  int triangleMode;
+  bool cullBackFaces;
+  bool used;
+}Mesh_t;
 
-//Vertex list
-typedef std::list<Vertex2_t> Vertex2List;
+//Triangle counters of one frame
+typedef struct{
+  int submitted; //assembled from vertices
+  int backFacing; //culled as back facing
+  int outsideFrustum; //culled as outside of view frustum
+  int clipped; //cut by near plane or guard band
+  int drawn; //sent to rasterizer, clipped ones may give more than one
+}RenderStats_t;
+
+//Nanoseconds spent in stages of one frame
+typedef struct{
+  Uint64 transform; //transforming submitted vertices
+  Uint64 setup; //assembling, culling, clipping and projecting triangles
+  Uint64 bin; //sorting triangles into tiles
+  Uint64 raster; //rasterizing tiles
+  Uint64 present; //copying frame to screen and showing it
+  Uint64 pacing; //sleeping to keep frame rate, not part of rendering
+}FrameTimes_t;
+
+//Frame handed from submitting thread to drawing one
+typedef struct{
+  VertexStream vertices; //transformed vertices
+  DrawBatchList batches; //draw batches over vertices
+  std::vector<char> tileClear; //tile is not drawn yet, it is shown cleared
+  Uint8* colorPlane; //color plane frame is rasterized into
+  int colorPitch; //bytes between rows of color plane
+  int renderMode; //render mode at submit
+  int rasterizer; //rasterizer at submit
+  bool enableLight; //lighting at submit
+  RenderStats_t stats; //triangle counters
+  FrameTimes_t times; //stage times
+  bool pending; //submitted and not shown yet
+}Frame_t;
+
+//Frames in flight, frame number n uses slot n % size
+typedef std::vector<Frame_t*> FrameList;
+
+//Mesh list, mesh handle is index in the list
+typedef std::vector<Mesh_t> MeshList;
+
+//Projected triangle list
+typedef std::vector<Triangle2_t> TriangleList;
+
+//Tile bin, indices of triangles touching the tile in submission order
+typedef std::vector<int> TileBin;
+typedef std::vector<TileBin> TileBinList;
 
 class Engine{
   public:
@@ -72,12 +112,39 @@ class Engine{
       RENDER_LINES
     }eRenderMode;
 
+    /** Rasterizer used for filled triangles. */
+    enum{
+      RASTER_SCANLINE,
+      RASTER_HALFSPACE
+    }eRasterizer;
+
+    /** Pixel blocks of half space rasterizer. */
+    enum{
+      PIXELS_SCALAR, //one pixel at a time
+      PIXELS_SSE2, //blocks of 4 pixels
+      PIXELS_AVX2 //blocks of 8 pixels
+    }ePixelKernel;
+
+    /** Frame pacing. */
+    enum{
+      PACING_UNCAPPED, //frames follow each other as fast as they are drawn
+      PACING_TARGET, //frames are spaced to target frame rate
+      PACING_IDLE //few frames per second, for minimized window
+    }ePacing;
+
     /** Triangle mode. */
     enum{
       TRIANGLE_NORMAL,
       TRIANGLE_STRIP
     }eTriangleMode;
 
+    /** Bounding volume against view frustum. */
+    enum{
+      VOLUME_OUTSIDE, //whole outside, nothing in it shows
+      VOLUME_INTERSECTS, //crosses some frustum plane
+      VOLUME_INSIDE //whole inside, nothing in it needs testing
+    }eVolume;
+
     /** Button indicator enum */
     enum{
       BUTTON_CUBE = 1,
@@ -85,7 +152,7 @@ class Engine{
       BUTTON_INTERUPT = 3
     }eButtonIndicator;
 
-    /** Constructor. Initialize the core components.
+    /** Constructor. Initialize the core components and open window.
     * @param width Width of screen (default=800).
     * @param height Height of screen (default=600).
     * @param bpp Bits per pixel (default=32).
@@ -93,6 +160,12 @@ class Engine{
     */
     Engine(int width = 800, int height = 600, int bpp = 32, bool fullscreen = false);
 
+    /** Constructor. Render with given backend. Menu, fonts and images are
+    * loaded only for interactive backends, others start in game state.
+    * @param backend Backend to render with, engine takes ownership.
+    */
+    explicit Engine(Backend* backend);
+
     /** Destructor. Shutdown all core components. */
     ~Engine();
 
@@ -122,7 +195,9 @@ class Engine{
     */
     void clearScreen();
 
-    /** Clear z buffer. */
+    /** Clear z buffer. Tiles are only marked for clearing, the real clear
+    * is done when tile is rasterized or presented.
+    */
     void clearZbuffer();
 
     /** Update screen. */
@@ -136,13 +211,92 @@ class Engine{
     */
     void setColor(float r, float g, float b, float a = 1.0f);
 
-    /** Add new vertex to render list.
+    /** Add new vertex to render list. Vertices are collected and transformed
+    * together when model view, triangle mode or submitted geometry changes,
+    * or frame ends.
     * @param x Vertex x coord.
     * @param y Vertex y coord.
     * @param z Vertex z coord.
     */
     void addVertex(float x, float y, float z);
 
+    /** Add block of vertices to render list.
+    * Vertices are transformed with the current model view matrix and
+    * assembled using the current triangle mode. Each vertex keeps its own color.
+    * @param vertices Vertices to add.
+    * @param count Number of vertices.
+    */
+    void submitVertices(const Vertex2_t* vertices, int count);
+
+    /** Add block of vertices with own triangle mode and culling, like
+    * mesh drawn once. Current triangle mode is not changed.
+    * @param vertices Vertices to add.
+    * @param count Number of vertices.
+    * @param triangleMode Triangle mode to assemble vertices with.
+    * @param cullBackFaces Cull back faces, as in setMeshCulling.
+    */
+    void submitVertices(const Vertex2_t* vertices, int count, int triangleMode, bool cullBackFaces);
+
+    /** @defgroup Engine Mesh related operations
+    * @{ */
+
+    /** Create empty mesh.
+    * @return Mesh handle.
+    */
+    int createMesh();
+
+    /** Set mesh vertices. Vertices are copied and kept in object space.
+    * @param mesh Mesh handle.
+    * @param vertices Vertices of the mesh.
+    * @param count Number of vertices.
+    * @param triangleMode Triangle mode to assemble vertices with.
+    */
+    void setMeshVertices(int mesh, const Vertex2_t* vertices, int count, int triangleMode);
+
+    /** Enable/disable back face culling of mesh. Front faces have normal
+    * (b - a) x (c - a) pointing to the eye, second triangle of strip quad is
+    * taken in reverse order. Culling is disabled for new meshes.
+    * @param mesh Mesh handle.
+    * @param cullBackFaces Cull back faces.
+    */
+    void setMeshCulling(int mesh, bool cullBackFaces);
+
+    /** Draw mesh with the current model view matrix.
+    * @param mesh Mesh handle.
+    */
+    void drawMesh(int mesh);
+
+    /** Draw copies of mesh with the current model view matrix. Model view
+    * is combined with offset and scale once per instance, vertices of each
+    * copy are transformed by the combined matrix.
+    * @param mesh Mesh handle.
+    * @param instances Offsets and scales of copies.
+    * @param count Number of instances.
+    */
+    void drawInstanced(int mesh, const Instance_t* instances, int count);
+
+    /** Size of sphere on screen under the current model view, for choosing
+    * level of detail.
+    * @param center Sphere center in object space.
+    * @param radius Sphere radius in object space.
+    * @return Diameter in pixels, infinity if sphere reaches near plane.
+    */
+    float getProjectedSize(const Point3_t& center, float radius) const;
+
+    /** Test sphere against view frustum under the current model view, so
+    * whole groups of meshes can be left out before they are submitted.
+    * @param center Sphere center in object space.
+    * @param radius Sphere radius in object space.
+    * @return VOLUME_OUTSIDE, VOLUME_INTERSECTS or VOLUME_INSIDE.
+    */
+    int testSphere(const Point3_t& center, float radius) const;
+
+    /** Destroy mesh, handle may be reused by next created mesh.
+    * @param mesh Mesh handle.
+    */
+    void destroyMesh(int mesh);
+    /** @} */
+
     /** Handle Input.
     * @param event Event queue.
     * @param buttonIndicator Indicates what button pressed.
@@ -158,9 +312,189 @@ class Engine{
     /** Set triangle mode, normal or strip. */
     void setTriangleMode(int mode);
 
+    /** Set number of threads rasterizing screen tiles.
+    * Output does not depend on number of threads.
+    * @param threads Number of threads, 1 rasterizes on calling thread only.
+    */
+    void setRasterThreads(int threads);
+
+    /** @return Number of threads rasterizing screen tiles. */
+    int getRasterThreads() const;
+
+    /** Set rasterizer of filled triangles, scanline or half space. */
+    void setRasterizer(int rasterizer);
+
+    /** @return Rasterizer of filled triangles. */
+    int getRasterizer() const;
+
+    /** Force pixel blocks of half space rasterizer, falls back to narrower
+    * blocks if CPU does not support requested kernel. Every kernel draws
+    * the same pixels.
+    * @param kernel Kernel to use, widest supported one is used by default.
+    */
+    void setPixelKernel(int kernel);
+
+    /** @return Pixel blocks of half space rasterizer. */
+    int getPixelKernel() const;
+
+    /** Set number of frames in flight. With more than one, updateScreen
+    * hands frame to render thread and shows frame submitted depth - 1
+    * calls before, so next frame is submitted while previous ones are
+    * rasterized. Shown frames do not depend on depth, only their latency.
+    * @param depth Frames in flight, 1 draws and shows frame in updateScreen.
+    */
+    void setPipelineDepth(int depth);
+
+    /** @return Number of frames in flight. */
+    int getPipelineDepth() const;
+
+    /** Set frame pacing. updateScreen sleeps only the part of frame budget
+    * the frame did not use, late frames are not delayed.
+    * @param pacing Pacing mode.
+    * @param frameRate Frames per second of PACING_TARGET.
+    */
+    void setFramePacing(int pacing, int frameRate = 60);
+
+    /** @return Frame pacing mode. */
+    int getFramePacing() const;
+
+    /** @return Triangle counters of last drawn frame. */
+    const RenderStats_t& getRenderStats() const;
+
+    /** @return Stage times of last drawn frame. */
+    const FrameTimes_t& getFrameTimes() const;
+
+    /** Set engine state, GAME_STATE skips the menu. */
+    void setState(int state);
+
   private:
-    /** Process Drawing. */
-    void processDrawing();
+    /** Initialize the core components.
+    * @param backend Backend to render with.
+    */
+    void init(Backend* backend);
+
+    /** Set up, bin and rasterize frame.
+    * @param frame Frame to draw.
+    */
+    void processDrawing(Frame_t& frame);
+
+    /** Move submitted vertices and settings to next frame slot.
+    * @return Frame slot.
+    */
+    Frame_t* submitFrame();
+
+    /** Wait until frame is drawn.
+    * @param number Frame number.
+    */
+    void waitFrame(Uint64 number);
+
+    /** Wait for all frames in flight.
+    * @param keepNewest Copy newest drawn frame to screen without showing it,
+    * next updateScreen shows it, older ones are dropped. Without it all frames
+    * are dropped, which is used when screen is about to be covered by menu or
+    * engine is destroyed.
+    */
+    void finishFrames(bool keepNewest);
+
+    /** Stop render thread, frames in flight must be finished. */
+    void stopRenderThread();
+
+    /** Free frame slots. */
+    void destroyFrames();
+
+    /** Render thread, draws submitted frames in order.
+    * @param engine Engine.
+    * @return Exit code.
+    */
+    static int renderMain(void* engine);
+
+    /** Sleep rest of frame budget of pacing mode. */
+    void paceFrame();
+
+    /** Transform vertices into render list.
+    * @param vertices Vertices in object space.
+    * @param triangleMode Triangle mode to assemble vertices with.
+    * @param cullBackFaces Cull back faces of assembled triangles.
+    * @param continues Vertices may finish triangle left open by previous ones.
+    */
+    void transformVertices(const VertexStream& vertices, int triangleMode, bool cullBackFaces, bool continues);
+
+    /** Transform vertices collected by addVertex. */
+    void flushVertices();
+
+    /** Open or extend draw batch for vertices about to be added.
+    * @param count Number of vertices to be added.
+    * @param triangleMode Triangle mode of the vertices.
+    * @param cullBackFaces Cull back faces of the vertices.
+    * @param continues Vertices may finish triangle left open by previous ones,
+    * as addVertex does, meshes always start new triangle.
+    */
+    void appendBatch(int count, int triangleMode, bool cullBackFaces, bool continues);
+
+    /** @return true if mesh handle is valid. */
+    bool meshValid(int mesh) const;
+
+    /** Set up clip planes of view frustum and guard band. */
+    void setupClipPlanes();
+
+    /** Cull, light, clip, project and store triangle for rasterization.
+    * @param face Face in camera space.
+    * @param cullBackFaces Cull face if it is back facing.
+    * @param reversed Face winding is reversed, like second triangle of strip quad.
+    */
+    void setupTriangle(Face_t& face, bool cullBackFaces, bool reversed = false);
+
+    /** @return true if face is turned away from the eye. */
+    bool isBackFace(const Face_t& face) const;
+
+    /** @return true if face is whole outside of one view frustum plane. */
+    bool outsideFrustum(const Face_t& face) const;
+
+    /** Clip face by near plane and guard band.
+    * @param face Face to clip.
+    * @param polygon Array of at least cMaxClipVertices to save clipped polygon into.
+    * @return Number of polygon vertices, 0 if nothing left.
+    */
+    int clipFace(const Face_t& face, Vertex2_t* polygon) const;
+
+    /** Sort projected triangles into screen tiles. */
+    void binTriangles();
+
+    /** Get tile rect.
+    * @param tile Tile index.
+    * @param rect Rect to save tile bounds into.
+    */
+    void getTileRect(int tile, ClipRect_t& rect) const;
+
+    /** Clear depth and color of tile of frame being drawn, if it is
+    * marked for clearing.
+    * @param tile Tile index.
+    */
+    void resolveTileClear(int tile);
+
+    /** Lock screen. */
+    void lockTarget();
+
+    /** Unlock screen. */
+    void unlockTarget();
+
+    /** Copy color plane of frame to locked screen, tiles nobody has drawn
+    * to are filled with clear color. Only those are written when rendering
+    * directly to screen.
+    * @param frame Drawn frame.
+    */
+    void presentTiles(const Frame_t& frame);
+
+    /** Choose raster functions specialized on screen pixel format and
+    * decide whether color plane can be screen itself.
+    */
+    void selectPixelFormat();
+
+    /** Rasterize all triangles of one tile, called from raster threads.
+    * @param engine Engine.
+    * @param tile Tile index.
+    */
+    template<class Format> static void rasterTileJob(void* engine, int tile);
 
     /** Project.
     * @param p3d 3D point to project.
@@ -169,24 +503,49 @@ class Engine{
     void project(const Vertex2_t& p3d, Point2_t& p2d) const;
 
     /** Draw triangle.
-    * @param screen Buffer to draw to.
-    * @param p1 First triangle point.
-    * @param p2 Second triangle point.
-    * @param p3 Third triangle point.
-    * @param color1 Color of first point.
-    * @param color2 Color of second point.
-    * @param color3 Color of third point.
+    * @param tri Projected triangle.
+    * @param clip Only pixels inside clip rect are drawn.
     */
-    void drawTriangle(Face_t& face);
+    template<class Format> void drawTriangle(const Triangle2_t& tri, const ClipRect_t& clip);
+
+    /** Draw filled triangle with edge functions.
+    * Falls back to drawTriangle when points are too far off screen for
+    * fixed point setup.
+    * @param tri Projected triangle.
+    * @param clip Only pixels inside clip rect are drawn.
+    */
+    template<class Format> void drawTriangleHalfSpace(const Triangle2_t& tri, const ClipRect_t& clip);
+
+    /** Set up half space triangle.
+    * @param tri Projected triangle.
+    * @param clip Clip rect.
+    * @param hs Setup to fill.
+    * @return false if triangle cannot be drawn with edge functions.
+    */
+    bool setupHalfSpace(const Triangle2_t& tri, const ClipRect_t& clip, HalfSpace_t& hs);
+
+    /** @{ */
+    /** Rasterize set up half space triangle.
+    * @param hs Triangle setup.
+    */
+    template<class Format> void rasterHalfSpaceScalar(const HalfSpace_t& hs);
+    template<class Format> void rasterHalfSpaceSSE2(const HalfSpace_t& hs);
+    template<class Format> void rasterHalfSpaceAVX2(const HalfSpace_t& hs);
+    /** @} */
 
     /** Draw horizontal line.
     * @param x1 First x.
     * @param x2 Second x.
     * @param y Y.
     * @param color1 First color.
+    * @param color2 Second color.
+    * @param z1 First depth.
+    * @param z2 Second depth.
+    * @param clip Only pixels inside clip rect are drawn.
     */
+    template<class Format>
     void drawHorizLine(Sint16 x1, Sint16 x2, Sint16 y, Color4_t color1, Color4_t color2,
-                       float z1, float z2);
+                       float z1, float z2, const ClipRect_t& clip);
 
     /** Draw line.
     * @param x1 First x.
@@ -194,16 +553,20 @@ class Engine{
     * @param x2 Second x.
     * @param y2 Second y.
     * @param color1 First color.
+    * @param clip Only pixels inside clip rect are drawn.
     */
-    void drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color);
+    template<class Format>
+    void drawLine(Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Color4_t color,
+                  const ClipRect_t& clip);
 
-    /** Put Pixel.
+    /** Put Pixel. Color is packed only if pixel passes depth test.
     * @param x X coord.
     * @param y Y coord.
     * @param color Color.
+    * @param z Depth.
     */
-    void putPixel(Sint16 x, Sint16 y, Color4_t color, float z);
-    void putPixel(Sint16 x, Sint16 y, Color4_t color);
+    template<class Format> void putPixel(Sint16 x, Sint16 y, Color4_t color, float z);
+    template<class Format> void putPixel(Sint16 x, Sint16 y, Color4_t color);
 
     /** Check if point in view.
     * @param x xCoord.
@@ -212,13 +575,6 @@ class Engine{
     */
     bool pointInView(Sint16 x, Sint16 y) const;
 
-    /** Check if triangle in view.
-    * @param p1 first veretx.
-    * @param p2 second veretx.
-    * @param p3 third veretx.
-    */
-    bool triangleInView(Point2_t& p1, Point2_t& p2, Point2_t& p3) const;
-
     /** Proccess Lightiht on each face.
     * @param face Face to proccess light on it.
     */
@@ -253,9 +609,33 @@ class Engine{
 
     float _perspectiveRatio; /**< Perspective ratio. */
 
+    Backend* _backend; /**< Backend owning the screen surface. */
     SDL_Surface* _screen; /**< Screen surface. */
 
-    Vertex2List _vertexList; /**< List of vertices to render. */
+    VertexStream _vertexList; /**< List of vertices to render. */
+    VertexStream _submitList; /**< Object space vertices of addVertex not transformed yet, and of submitVertices. */
+    DrawBatchList _batchList; /**< Draw batches over vertex list. */
+
+    FrameList _frames; /**< Frame slots. */
+    Frame_t* _drawFrame; /**< Frame being drawn, used by drawing thread only. */
+    SDL_Thread* _renderThread; /**< Thread drawing frames, 0 if only one frame is in flight. */
+    SDL_mutex* _frameMutex; /**< Guards frame counters. */
+    SDL_cond* _frameCond; /**< Signals submitted and drawn frames. */
+    Uint64 _framesSubmitted; /**< Frames ever submitted. */
+    Uint64 _framesDrawn; /**< Frames ever drawn. */
+    bool _quitRender; /**< Render thread should exit. */
+
+    MeshList _meshList; /**< Meshes, indexed by handle. */
+
+    TriangleList _triangleList; /**< Projected triangles of current frame. */
+    TileBinList _tileBins; /**< Triangle bins, one per screen tile. */
+    int _tilesX; /**< Number of tile columns. */
+    int _tilesY; /**< Number of tile rows. */
+    ThreadPool* _rasterPool; /**< Threads rasterizing tiles. */
+    int _rasterNode; /**< Profiler node of raster stage, parent of tile zones on all threads. */
+
+    int _rasterizer; /**< Rasterizer of filled triangles. */
+    int _pixelKernel; /**< Pixel blocks of half space rasterizer. */
 
     int _engineState; /**< State of engine. */
 
@@ -269,18 +649,34 @@ class Engine{
 
     float _lastTime; /**< Used for fps. */
 
-    ZBuffer_t** _zbuffer; /**< Z-Buffer. */
+    float* _depthPlane; /**< Z-Buffer depth, row major. */
+    int _depthPitch; /**< Pixels between rows of depth plane. */
+    Uint8* _colorPlane; /**< Z-Buffer color of frame being drawn, row major, may be screen pixels. */
+    int _colorPitch; /**< Bytes between rows of color plane. */
+    int _colorBytes; /**< Bytes per color plane pixel. */
+    bool _canZeroCopy; /**< Screen stores pixels like color plane. */
+    bool _zeroCopy; /**< Color plane is screen pixels, only with one frame in flight. */
+    JobFunc _rasterTileJob; /**< rasterTileJob specialized on screen pixel format. */
+    std::vector<char> _tileClear; /**< Tile of submitted frame needs clearing before its pixels are used. */
 
     int _renderMode; /**< Render mode. */
     int _triangleMode; /**< Triangle Mode. */
 
+    ClipPlane_t _frustumPlanes[5]; /**< Near, left, right, top and bottom planes of view. */
+    ClipPlane_t _clipPlanes[5]; /**< Near plane and guard band triangles are clipped by. */
+    RenderStats_t _lastStats; /**< Counters of last shown frame. */
+    FrameTimes_t _times; /**< Stage times of frame being submitted. */
+    FrameTimes_t _lastTimes; /**< Stage times of last shown frame. */
+    int _pacing; /**< Frame pacing mode. */
+    Uint64 _frameBudget; /**< Frame time of target frame rate in nanoseconds. */
+    Uint64 _frameDeadline; /**< Time last frame was due at. */
+
     bool _enableLight; /**< Enable/disbale light indicator. */
     float _lightCoficient; /**< Light coficient. */
 
     int _vertices; /**< Num vertices. */
 
     #ifdef _DEBUG
-    ProfileManager _pfManager;
     SDL_Surface* _pfRegistred;
     #endif
     SDL_Surface* _credit; /**< Credits. */
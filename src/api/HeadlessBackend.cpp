@@ -0,0 +1,41 @@
+/**
+* @file HeadlessBackend.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of headless backend class.
+*/
+
+#include "HeadlessBackend.hpp"
+#include "../utils/Exception.hpp"
+
+HeadlessBackend::HeadlessBackend(int width, int height, int bpp)
+{
+  //Same layouts a window usually gets, so the same raster paths are used
+  if(bpp == 16)
+    _surface = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 16, 0xF800, 0x7E0, 0x1F, 0);
+  else if(bpp == 32)
+    _surface = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+  else
+    throw Exception("Headless backend supports only 16 and 32 bits per pixel");
+
+  if(_surface == 0)
+    throw Exception("Cannot create framebuffer");
+}
+
+HeadlessBackend::~HeadlessBackend()
+{
+  SDL_FreeSurface(_surface);
+}
+
+SDL_Surface* HeadlessBackend::getSurface()
+{
+  return _surface;
+}
+
+void HeadlessBackend::present()
+{
+}
+
+bool HeadlessBackend::isInteractive() const
+{
+  return false;
+}
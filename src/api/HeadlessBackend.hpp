@@ -0,0 +1,35 @@
+/**
+* @file HeadlessBackend.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of headless backend class.
+* Renders into surface in memory, needs no display. Frames can be saved
+* with savePPM/saveBMP, benchmark saves its last frame with --dump.
+* BMP stands in for PNG, SDL 1.2 writes no PNG without extra library.
+*/
+
+#ifndef HEADLESSBACKEND_HPP_INCLUDED
+#define HEADLESSBACKEND_HPP_INCLUDED
+
+#include "Backend.hpp"
+
+class HeadlessBackend: public Backend{
+  public:
+    /** Create framebuffer in memory.
+    * @param width Width of framebuffer.
+    * @param height Height of framebuffer.
+    * @param bpp Bits per pixel, 32 (XRGB8888) or 16 (RGB565).
+    */
+    HeadlessBackend(int width, int height, int bpp = 32);
+
+    /** Destructor. Free framebuffer. */
+    ~HeadlessBackend();
+
+    SDL_Surface* getSurface();
+    void present();
+    bool isInteractive() const;
+
+  private:
+    SDL_Surface* _surface; /**< Framebuffer. */
+};
+
+#endif // HEADLESSBACKEND_HPP_INCLUDED
@@ -0,0 +1,184 @@
+/**
+* @file PixelFormat.hpp
+* @author Dmitri Koudriavtsev
+* @brief Destination pixel formats the rasterizer is specialized on.
+*
+* Every format has pixel type and static pack() turning 8 bit components
+* to pixel. Known formats pack with constant shifts, PixelMapped asks SDL
+* and is used for anything else. On x86 pack4()/pack8() pack block of
+* pixels from components in 32 bit lanes, pixels come out in 32 bit lanes.
+*/
+
+#ifndef PIXELFORMAT_HPP_INCLUDED
+#define PIXELFORMAT_HPP_INCLUDED
+
+#include <SDL/SDL.h>
+
+#include "../math/Cpu.hpp"
+
+//32 bit 0x00RRGGBB
+struct PixelXRGB8888{
+  typedef Uint32 Pixel;
+
+  static Pixel pack(const SDL_PixelFormat*, Uint8 r, Uint8 g, Uint8 b)
+  {
+    return (static_cast<Uint32>(r) << 16) | (static_cast<Uint32>(g) << 8) | b;
+  }
+
+  #ifdef CPU_X86
+  TARGET_SSE2
+  static __m128i pack4(const SDL_PixelFormat*, __m128i r, __m128i g, __m128i b)
+  {
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+  }
+
+  TARGET_AVX2
+  static __m256i pack8(const SDL_PixelFormat*, __m256i r, __m256i g, __m256i b)
+  {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+  }
+  #endif
+
+  static bool matches(const SDL_PixelFormat* format)
+  {
+    return (format->BytesPerPixel == 4) && (format->Rmask == 0xFF0000) &&
+           (format->Gmask == 0xFF00) && (format->Bmask == 0xFF) && (format->Amask == 0);
+  }
+};
+
+//32 bit 0x00BBGGRR
+struct PixelXBGR8888{
+  typedef Uint32 Pixel;
+
+  static Pixel pack(const SDL_PixelFormat*, Uint8 r, Uint8 g, Uint8 b)
+  {
+    return (static_cast<Uint32>(b) << 16) | (static_cast<Uint32>(g) << 8) | r;
+  }
+
+  #ifdef CPU_X86
+  TARGET_SSE2
+  static __m128i pack4(const SDL_PixelFormat*, __m128i r, __m128i g, __m128i b)
+  {
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(g, 8)), r);
+  }
+
+  TARGET_AVX2
+  static __m256i pack8(const SDL_PixelFormat*, __m256i r, __m256i g, __m256i b)
+  {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_slli_epi32(g, 8)), r);
+  }
+  #endif
+
+  static bool matches(const SDL_PixelFormat* format)
+  {
+    return (format->BytesPerPixel == 4) && (format->Rmask == 0xFF) &&
+           (format->Gmask == 0xFF00) && (format->Bmask == 0xFF0000) && (format->Amask == 0);
+  }
+};
+
+//16 bit RRRRRGGGGGGBBBBB
+struct PixelRGB565{
+  typedef Uint16 Pixel;
+
+  static Pixel pack(const SDL_PixelFormat*, Uint8 r, Uint8 g, Uint8 b)
+  {
+    return static_cast<Uint16>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+  }
+
+  #ifdef CPU_X86
+  TARGET_SSE2
+  static __m128i pack4(const SDL_PixelFormat*, __m128i r, __m128i g, __m128i b)
+  {
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(r, 3), 11),
+                                     _mm_slli_epi32(_mm_srli_epi32(g, 2), 5)), _mm_srli_epi32(b, 3));
+  }
+
+  TARGET_AVX2
+  static __m256i pack8(const SDL_PixelFormat*, __m256i r, __m256i g, __m256i b)
+  {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_srli_epi32(r, 3), 11),
+                                           _mm256_slli_epi32(_mm256_srli_epi32(g, 2), 5)), _mm256_srli_epi32(b, 3));
+  }
+  #endif
+
+  static bool matches(const SDL_PixelFormat* format)
+  {
+    return (format->BytesPerPixel == 2) && (format->Rmask == 0xF800) &&
+           (format->Gmask == 0x7E0) && (format->Bmask == 0x1F) && (format->Amask == 0);
+  }
+};
+
+//16 bit XRRRRRGGGGGBBBBB
+struct PixelRGB555{
+  typedef Uint16 Pixel;
+
+  static Pixel pack(const SDL_PixelFormat*, Uint8 r, Uint8 g, Uint8 b)
+  {
+    return static_cast<Uint16>(((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3));
+  }
+
+  #ifdef CPU_X86
+  TARGET_SSE2
+  static __m128i pack4(const SDL_PixelFormat*, __m128i r, __m128i g, __m128i b)
+  {
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(r, 3), 10),
+                                     _mm_slli_epi32(_mm_srli_epi32(g, 3), 5)), _mm_srli_epi32(b, 3));
+  }
+
+  TARGET_AVX2
+  static __m256i pack8(const SDL_PixelFormat*, __m256i r, __m256i g, __m256i b)
+  {
+    return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_srli_epi32(r, 3), 10),
+                                           _mm256_slli_epi32(_mm256_srli_epi32(g, 3), 5)), _mm256_srli_epi32(b, 3));
+  }
+  #endif
+
+  static bool matches(const SDL_PixelFormat* format)
+  {
+    return (format->BytesPerPixel == 2) && (format->Rmask == 0x7C00) &&
+           (format->Gmask == 0x3E0) && (format->Bmask == 0x1F) && (format->Amask == 0);
+  }
+};
+
+//Any other format, 32 bit pixel mapped by SDL and converted on present
+struct PixelMapped{
+  typedef Uint32 Pixel;
+
+  static Pixel pack(const SDL_PixelFormat* format, Uint8 r, Uint8 g, Uint8 b)
+  {
+    return SDL_MapRGB(const_cast<SDL_PixelFormat*>(format), r, g, b);
+  }
+
+  #ifdef CPU_X86
+  TARGET_SSE2
+  static __m128i pack4(const SDL_PixelFormat* format, __m128i r, __m128i g, __m128i b)
+  {
+    Uint32 cr[4], cg[4], cb[4], pixels[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cr), r);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cg), g);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cb), b);
+    for(int i = 0; i < 4; i++)
+      pixels[i] = pack(format, cr[i], cg[i], cb[i]);
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+  }
+
+  TARGET_AVX2
+  static __m256i pack8(const SDL_PixelFormat* format, __m256i r, __m256i g, __m256i b)
+  {
+    Uint32 cr[8], cg[8], cb[8], pixels[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(cr), r);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(cg), g);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(cb), b);
+    for(int i = 0; i < 8; i++)
+      pixels[i] = pack(format, cr[i], cg[i], cb[i]);
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels));
+  }
+  #endif
+
+  static bool matches(const SDL_PixelFormat*)
+  {
+    return true;
+  }
+};
+
+#endif // PIXELFORMAT_HPP_INCLUDED
@@ -0,0 +1,67 @@
+/**
+* @file Types.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of basic rendering types.
+*/
+
+#ifndef TYPES_HPP_INCLUDED
+#define TYPES_HPP_INCLUDED
+
+#include <SDL/SDL.h>
+
+//3d Point
+typedef struct{
+  float x, y, z;
+}Point3_t;
+
+//Color with 4 components (+alpha)
+typedef struct{
+  float r, g, b, a;
+}Color4_t;
+
+//point
+typedef struct{
+  Sint16 x, y;
+  Color4_t color;
+  float z;
+  float sx, sy; //sub pixel x, y
+}Point2_t;
+
+//Vertex
+typedef struct{
+  Point3_t point;
+  Color4_t color;
+}Vertex2_t;
+
+//Face
+typedef struct{
+  Vertex2_t a, b, c;
+}Face_t;
+
+//Projected triangle
+typedef struct{
+  Point2_t a, b, c;
+}Triangle2_t;
+
+//Clip plane in camera space, point is inside if a*x + b*y + c*z + d >= 0
+typedef struct{
+  float a, b, c, d;
+}ClipPlane_t;
+
+//Clip rectangle, bounds are inclusive
+typedef struct{
+  int x1, y1, x2, y2;
+}ClipRect_t;
+
+//Half space triangle setup, edge values and attributes at first pixel
+//center of bounding box, with per pixel steps
+typedef struct{
+  int x1, y1, x2, y2;
+  int e[3], edx[3], edy[3];
+  float z, dzdx, dzdy;
+  float r, drdx, drdy;
+  float g, dgdx, dgdy;
+  float b, dbdx, dbdy;
+}HalfSpace_t;
+
+#endif // TYPES_HPP_INCLUDED
@@ -0,0 +1,187 @@
+/**
+* @file VertexStream.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of vertex stream class.
+*/
+
+#include <algorithm>
+
+#include "VertexStream.hpp"
+#include "../utils/Memory.hpp"
+
+VertexStream::VertexStream()
+{
+  _x = 0;
+  _y = 0;
+  _z = 0;
+  _color = 0;
+  _size = 0;
+  _capacity = 0;
+}
+
+VertexStream::VertexStream(const VertexStream& stream)
+{
+  _x = 0;
+  _y = 0;
+  _z = 0;
+  _color = 0;
+  _size = 0;
+  _capacity = 0;
+
+  reserve(stream._size);
+  std::copy(stream._x, stream._x + stream._size, _x);
+  std::copy(stream._y, stream._y + stream._size, _y);
+  std::copy(stream._z, stream._z + stream._size, _z);
+  std::copy(stream._color, stream._color + stream._size, _color);
+  _size = stream._size;
+}
+
+VertexStream::~VertexStream()
+{
+  alignedFree(_x);
+  alignedFree(_y);
+  alignedFree(_z);
+  alignedFree(_color);
+}
+
+VertexStream& VertexStream::operator=(const VertexStream& stream)
+{
+  if(this != &stream) {
+    VertexStream copy(stream);
+    swap(copy);
+  }
+
+  return *this;
+}
+
+int VertexStream::size() const
+{
+  return _size;
+}
+
+bool VertexStream::empty() const
+{
+  return _size == 0;
+}
+
+void VertexStream::clear()
+{
+  _size = 0;
+}
+
+void VertexStream::reserve(int count)
+{
+  if(count <= _capacity)
+    return;
+
+  float* x = static_cast<float*>(alignedMalloc(count * sizeof(float)));
+  float* y = 0;
+  float* z = 0;
+  Color4_t* color = 0;
+  try {
+    y = static_cast<float*>(alignedMalloc(count * sizeof(float)));
+    z = static_cast<float*>(alignedMalloc(count * sizeof(float)));
+    color = static_cast<Color4_t*>(alignedMalloc(count * sizeof(Color4_t)));
+  } catch(...) {
+    alignedFree(x);
+    alignedFree(y);
+    alignedFree(z);
+    throw;
+  }
+
+  std::copy(_x, _x + _size, x);
+  std::copy(_y, _y + _size, y);
+  std::copy(_z, _z + _size, z);
+  std::copy(_color, _color + _size, color);
+
+  alignedFree(_x);
+  alignedFree(_y);
+  alignedFree(_z);
+  alignedFree(_color);
+
+  _x = x;
+  _y = y;
+  _z = z;
+  _color = color;
+  _capacity = count;
+}
+
+void VertexStream::resize(int count)
+{
+  //Grow geometrically, so vertices appended one batch at a time are not copied each time
+  if(count > _capacity)
+    reserve(std::max(count, 2 * _capacity));
+
+  _size = count;
+}
+
+void VertexStream::append(const Vertex2_t* vertices, int count)
+{
+  int first = _size;
+  resize(first + count);
+
+  for(int i = 0; i < count; i++) {
+    _x[first + i] = vertices[i].point.x;
+    _y[first + i] = vertices[i].point.y;
+    _z[first + i] = vertices[i].point.z;
+    _color[first + i] = vertices[i].color;
+  }
+}
+
+void VertexStream::get(int i, Vertex2_t& v) const
+{
+  v.point.x = _x[i];
+  v.point.y = _y[i];
+  v.point.z = _z[i];
+  v.color = _color[i];
+}
+
+float* VertexStream::x()
+{
+  return _x;
+}
+
+float* VertexStream::y()
+{
+  return _y;
+}
+
+float* VertexStream::z()
+{
+  return _z;
+}
+
+Color4_t* VertexStream::color()
+{
+  return _color;
+}
+
+const float* VertexStream::x() const
+{
+  return _x;
+}
+
+const float* VertexStream::y() const
+{
+  return _y;
+}
+
+const float* VertexStream::z() const
+{
+  return _z;
+}
+
+const Color4_t* VertexStream::color() const
+{
+  return _color;
+}
+
+void VertexStream::swap(VertexStream& stream)
+{
+  std::swap(_x, stream._x);
+  std::swap(_y, stream._y);
+  std::swap(_z, stream._z);
+  std::swap(_color, stream._color);
+  std::swap(_size, stream._size);
+  std::swap(_capacity, stream._capacity);
+}
@@ -0,0 +1,92 @@
+/**
+* @file VertexStream.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of vertex stream class.
+* Vertices are stored as structure of arrays, so positions can be
+* transformed in batches. Arrays are aligned to cache line, so SIMD
+* kernels may use aligned loads from their start.
+*/
+
+#ifndef VERTEXSTREAM_HPP_INCLUDED
+#define VERTEXSTREAM_HPP_INCLUDED
+
+#include "Types.hpp"
+
+class VertexStream{
+  public:
+    /** Create empty stream. */
+    VertexStream();
+
+    /** Copy constructor.
+    * @param stream Stream to copy.
+    */
+    VertexStream(const VertexStream& stream);
+
+    /** Destructor. */
+    ~VertexStream();
+
+    /** Assignment operator.
+    * @param stream Stream to copy.
+    * @return Reference to this stream.
+    */
+    VertexStream& operator=(const VertexStream& stream);
+
+    /** @return Number of vertices. */
+    int size() const;
+
+    /** @return true if stream has no vertices. */
+    bool empty() const;
+
+    /** Remove all vertices, memory is kept. */
+    void clear();
+
+    /** Reserve memory.
+    * @param count Number of vertices to reserve memory for.
+    */
+    void reserve(int count);
+
+    /** Resize stream, new vertices are not initialized, caller must write them.
+    * @param count New number of vertices.
+    */
+    void resize(int count);
+
+    /** Add vertices.
+    * @param vertices Vertices to add.
+    * @param count Number of vertices.
+    */
+    void append(const Vertex2_t* vertices, int count);
+
+    /** Get single vertex.
+    * @param i Vertex index.
+    * @param v Reference to save vertex into.
+    */
+    void get(int i, Vertex2_t& v) const;
+
+    /** @defgroup VertexStream Component arrays
+    * @{ */
+    float* x();
+    float* y();
+    float* z();
+    Color4_t* color();
+
+    const float* x() const;
+    const float* y() const;
+    const float* z() const;
+    const Color4_t* color() const;
+    /** @} */
+
+    /** Swap content with other stream.
+    * @param stream Stream to swap with.
+    */
+    void swap(VertexStream& stream);
+
+  private:
+    float* _x; /**< X coords. */
+    float* _y; /**< Y coords. */
+    float* _z; /**< Z coords. */
+    Color4_t* _color; /**< Colors. */
+    int _size; /**< Number of vertices. */
+    int _capacity; /**< Number of vertices memory is allocated for. */
+};
+
+#endif // VERTEXSTREAM_HPP_INCLUDED
@@ -0,0 +1,47 @@
+/**
+* @file WindowBackend.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of window backend class.
+*/
+
+#include "WindowBackend.hpp"
+#include "../utils/Exception.hpp"
+
+WindowBackend::WindowBackend(int width, int height, int bpp, bool fullscreen)
+{
+  if(SDL_Init(SDL_INIT_VIDEO) == -1)
+    throw Exception("Cannot initialize SDL");
+
+  Uint32 flags = SDL_SWSURFACE | SDL_DOUBLEBUF;
+  if(fullscreen)
+    flags |= SDL_FULLSCREEN;
+
+  if((_screen = SDL_SetVideoMode(width, height, bpp, flags)) == 0) {
+    SDL_Quit();
+    throw Exception("Cannot set video mode");
+  }
+
+  SDL_WM_SetCaption("3D fractals!", 0);
+  SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+}
+
+WindowBackend::~WindowBackend()
+{
+  if(SDL_WasInit(SDL_INIT_VIDEO))
+    SDL_Quit();
+}
+
+SDL_Surface* WindowBackend::getSurface()
+{
+  return _screen;
+}
+
+void WindowBackend::present()
+{
+  SDL_Flip(_screen);
+}
+
+bool WindowBackend::isInteractive() const
+{
+  return true;
+}
@@ -0,0 +1,34 @@
+/**
+* @file WindowBackend.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of window backend class.
+* Renders into SDL video surface of a window.
+*/
+
+#ifndef WINDOWBACKEND_HPP_INCLUDED
+#define WINDOWBACKEND_HPP_INCLUDED
+
+#include "Backend.hpp"
+
+class WindowBackend: public Backend{
+  public:
+    /** Initialize SDL video and open window.
+    * @param width Width of screen.
+    * @param height Height of screen.
+    * @param bpp Bits per pixel.
+    * @param fullscreen Enable/disable fullscreen.
+    */
+    WindowBackend(int width, int height, int bpp, bool fullscreen);
+
+    /** Destructor. Shutdown SDL. */
+    ~WindowBackend();
+
+    SDL_Surface* getSurface();
+    void present();
+    bool isInteractive() const;
+
+  private:
+    SDL_Surface* _screen; /**< Screen surface. */
+};
+
+#endif // WINDOWBACKEND_HPP_INCLUDED
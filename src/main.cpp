@@ -1,68 +1,432 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
 
 #include <SDL/SDL.h>
 
 #include "api/Engine.hpp"
+#include "api/WindowBackend.hpp"
+#include "api/HeadlessBackend.hpp"
 #include "utils/Exception.hpp"
+#include "utils/Profiler.hpp"
+#include "math/Transform.hpp"
 #include "Fractal.hpp"
+#include "Benchmark.hpp"
 
-/** Draw Board
-* Draw a chess board under the figures
+const int cZoneFrame = Profiler::getInstance().registerZone("frame", true);
+const float cLodThreshold = 3.0f; /**< Sub cubes smaller on screen are not drawn, their cube is */
+
+/** Set Board Vertex
+* Fill one board vertex
+* @param v Vertex to fill
+* @param x/y/z Vertex coords
+* @param c Gray level of the vertex
+*/
+void setBoardVertex(Vertex2_t& v, float x, float y, float z, float c){
+  v.point.x = x;
+  v.point.y = y;
+  v.point.z = z;
+  v.color.r = v.color.g = v.color.b = c;
+  v.color.a = 1.0f;
+}
+
+/** Create Board
+* Create mesh of a chess board under the figures
 * @param renderer Engine renderer the one that handles rendering
-* @param figure Determine what figure we are drawing the bodrd for.
+* @param figure Determine what figure we are creating the bodrd for.
+* @return Board mesh handle
 */
-void drawBoard(Engine& renderer, int figure){
+int createBoard(Engine& renderer, int figure){
   float size = 800; //Half size of board
   float step = 200; //One step
+  Vertex2_t board[9 * 9 * 6]; //9x9 squares, at most 6 vertices each
+  int n = 0;
+  int mode = Engine::TRIANGLE_NORMAL;
 
   //If figure is cube draw board using strip triangles
   if(figure == Engine::BUTTON_CUBE){
     float sizey = -182.0;
-    renderer.setTriangleMode(Engine::TRIANGLE_STRIP);
+    mode = Engine::TRIANGLE_STRIP;
 
     int count = 0;
     for(float i = -size; i <= size; i += step){
       for(float j = -size; j <= size; j += step){
-        if(count % 2 == 0)
-          renderer.setColor(0.0, 0.0, 0.0);
-        else
-          renderer.setColor(1.0, 1.0, 1.0);
-        renderer.addVertex(i       , sizey, j);
-        renderer.addVertex(i + step, sizey, j);
-        renderer.addVertex(i       , sizey, j + step);
-        renderer.addVertex(i + step, sizey, j + step);
+        float c = (count % 2 == 0) ? 0.0f : 1.0f;
+        setBoardVertex(board[n++], i       , sizey, j       , c);
+        setBoardVertex(board[n++], i + step, sizey, j       , c);
+        setBoardVertex(board[n++], i       , sizey, j + step, c);
+        setBoardVertex(board[n++], i + step, sizey, j + step, c);
         count++;
       }
     }
   }else if(figure == Engine::BUTTON_PYRAMID){ //If figure is pyramid draw board using normal triangles
     float sizey = -122.0;
-    renderer.setTriangleMode(Engine::TRIANGLE_NORMAL);
+    mode = Engine::TRIANGLE_NORMAL;
 
     int count = 0;
     for(float i = -size; i <= size; i += step){
       for(float j = -size; j <= size; j += step){
-        if(count % 2 == 0)
-          renderer.setColor(0.0, 0.0, 0.0);
-        else
-          renderer.setColor(1.0, 1.0, 1.0);
-        renderer.addVertex(i       , sizey, j);
-        renderer.addVertex(i + step, sizey, j);
-        renderer.addVertex(i       , sizey, j + step);
-
-        renderer.addVertex(i + step, sizey, j);
-        renderer.addVertex(i       , sizey, j + step);
-        renderer.addVertex(i + step, sizey, j + step);
+        float c = (count % 2 == 0) ? 0.0f : 1.0f;
+        setBoardVertex(board[n++], i       , sizey, j       , c);
+        setBoardVertex(board[n++], i + step, sizey, j       , c);
+        setBoardVertex(board[n++], i       , sizey, j + step, c);
+
+        setBoardVertex(board[n++], i + step, sizey, j       , c);
+        setBoardVertex(board[n++], i       , sizey, j + step, c);
+        setBoardVertex(board[n++], i + step, sizey, j + step, c);
         count++;
       }
     }
   }
+
+  int mesh = renderer.createMesh();
+  renderer.setMeshVertices(mesh, board, n, mode);
+  return mesh;
+}
+
+/** Render Scene
+* Draw fixed frame of cube fractal over board, checks compare it between settings
+* @param sk Engine renderer the one that handles rendering
+* @param board Board mesh handle
+* @param fractal Fractal to draw
+* @param screen Screen surface of headless backend
+* @param pixels Pixels of drawn frame
+*/
+void renderScene(Engine& sk, int board, Fractal& fractal, SDL_Surface* screen, std::vector<Uint8>& pixels){
+  sk.clearScreen();
+  sk.clearZbuffer();
+  sk.loadIdentity();
+  sk.translate(200.0f, -150.0f, 6000.0f);
+  sk.rotate(-30.0f, 1, 0, 0);
+  sk.rotate(60.0f, 0, 1, 0);
+  sk.rotate(5.0f, 0, 0, 1);
+  sk.drawMesh(board);
+  fractal.render(sk);
+  sk.updateScreen();
+
+  const Uint8* p = static_cast<const Uint8*>(screen->pixels);
+  pixels.assign(p, p + screen->pitch * screen->h);
+}
+
+/** Run Self Test
+* Check engine behavior that drawing relies on, in headless engine
+* @return Exit code, 0 if every check passed
+*/
+int runSelfTest(){
+  HeadlessBackend* backend = new HeadlessBackend(256, 192, 32);
+  Engine sk(backend);
+  SDL_Surface* screen = backend->getSurface();
+  //Pixel of point (18, 17), inside both shapes drawn below
+  Uint32* probe = reinterpret_cast<Uint32*>(static_cast<Uint8*>(screen->pixels) + (screen->h / 2 - 17) * screen->pitch)
+                  + screen->w / 2 + 18;
+  sk.setState(Engine::GAME_STATE);
+  sk.setRenderMode(Engine::RENDER_FILLED);
+  int failed = 0;
+
+  //Vertices added one by one make triangle together
+  sk.loadIdentity();
+  sk.setTriangleMode(Engine::TRIANGLE_NORMAL);
+  sk.addVertex(10.0f, 10.0f, 0.0f);
+  sk.addVertex(50.0f, 10.0f, 0.0f);
+  sk.addVertex(10.0f, 50.0f, 0.0f);
+  sk.updateScreen();
+  if(sk.getRenderStats().submitted != 1){
+    std::cout << "addVertex: 3 vertices made " << sk.getRenderStats().submitted
+              << " triangles, expected 1" << std::endl;
+    failed++;
+  }
+
+  //Frame in flight is kept on screen when pipeline depth changes, not dropped or flipped
+  Uint32 before = *probe;
+  sk.setPipelineDepth(2);
+  sk.setColor(1.0f, 0.0f, 0.0f);
+  sk.addVertex(10.0f, 10.0f, 0.0f);
+  sk.addVertex(50.0f, 10.0f, 0.0f);
+  sk.addVertex(10.0f, 50.0f, 0.0f);
+  sk.addVertex(50.0f, 10.0f, 0.0f);
+  sk.addVertex(50.0f, 50.0f, 0.0f);
+  sk.addVertex(10.0f, 50.0f, 0.0f);
+  sk.updateScreen();
+  sk.setPipelineDepth(1);
+  sk.setColor(1.0f, 1.0f, 1.0f);
+  if((sk.getRenderStats().submitted != 2) || (*probe == before)){
+    std::cout << "setPipelineDepth: kept frame has " << sk.getRenderStats().submitted
+              << " triangles, expected 2 on screen" << std::endl;
+    failed++;
+  }
+
+  //Scene drawn by every transform kernel this CPU has is the same
+  int board = createBoard(sk, Engine::BUTTON_CUBE);
+  FractalCube cube;
+  cube.setRenderer(sk);
+  cube.addLevel();
+  std::vector<Uint8> expected, pixels;
+  int kernel = getTransformKernel();
+  setTransformKernel(TRANSFORM_SCALAR);
+  renderScene(sk, board, cube, screen, expected);
+  for(int k = TRANSFORM_SSE2; k <= TRANSFORM_AVX2; k++){
+    setTransformKernel(k);
+    if(getTransformKernel() != k)
+      continue;
+    renderScene(sk, board, cube, screen, pixels);
+    if(pixels != expected){
+      std::cout << "transform kernel " << k << ": frame differs from scalar kernel" << std::endl;
+      failed++;
+    }
+  }
+  setTransformKernel(kernel);
+
+  //Tiles drawn by several threads make the same frame as one thread
+  int rasterizer = sk.getRasterizer();
+  int threads = sk.getRasterThreads();
+  for(int r = Engine::RASTER_SCANLINE; r <= Engine::RASTER_HALFSPACE; r++){
+    sk.setRasterizer(r);
+    sk.setRasterThreads(1);
+    renderScene(sk, board, cube, screen, expected);
+    sk.setRasterThreads(4);
+    renderScene(sk, board, cube, screen, pixels);
+    if(pixels != expected){
+      std::cout << "raster threads, rasterizer " << r << ": 4 threads draw other frame than 1" << std::endl;
+      failed++;
+    }
+  }
+  sk.setRasterizer(rasterizer);
+  sk.setRasterThreads(threads);
+
+  //Pixel blocks of every width this CPU has draw the same half space frame
+  int pixelKernel = sk.getPixelKernel();
+  sk.setRasterizer(Engine::RASTER_HALFSPACE);
+  sk.setPixelKernel(Engine::PIXELS_SCALAR);
+  renderScene(sk, board, cube, screen, expected);
+  for(int k = Engine::PIXELS_SSE2; k <= Engine::PIXELS_AVX2; k++){
+    sk.setPixelKernel(k);
+    if(sk.getPixelKernel() != k)
+      continue;
+    renderScene(sk, board, cube, screen, pixels);
+    if(pixels != expected){
+      std::cout << "pixel kernel " << k << ": frame differs from scalar kernel" << std::endl;
+      failed++;
+    }
+  }
+  sk.setPixelKernel(pixelKernel);
+
+  //Rectangle with corners on pixel grid, half space leaves its right and
+  //bottom edges to neighbours by top-left rule, scanline fills the same inside
+  std::vector<Uint8> rect[2];
+  for(int r = Engine::RASTER_SCANLINE; r <= Engine::RASTER_HALFSPACE; r++){
+    sk.setRasterizer(r);
+    sk.clearScreen();
+    sk.clearZbuffer();
+    sk.loadIdentity();
+    sk.addVertex(-40.0f, 0.0f, 0.0f);
+    sk.addVertex(0.0f, 0.0f, 0.0f);
+    sk.addVertex(-40.0f, 40.0f, 0.0f);
+    sk.addVertex(0.0f, 0.0f, 0.0f);
+    sk.addVertex(0.0f, 40.0f, 0.0f);
+    sk.addVertex(-40.0f, 40.0f, 0.0f);
+    sk.updateScreen();
+    const Uint8* p = static_cast<const Uint8*>(screen->pixels);
+    rect[r].assign(p, p + screen->pitch * screen->h);
+  }
+  sk.setRasterizer(rasterizer);
+
+  Uint32 clear = SDL_MapRGB(screen->format, 128, 128, 128);
+  int x1 = screen->w / 2 - 40, x2 = screen->w / 2;
+  int y1 = screen->h / 2 - 40, y2 = screen->h / 2;
+  int wrong = 0;
+  for(int y = y1 - 2; y <= y2 + 2; y++){
+    const Uint32* scanline = reinterpret_cast<const Uint32*>(&rect[Engine::RASTER_SCANLINE][y * screen->pitch]);
+    const Uint32* halfSpace = reinterpret_cast<const Uint32*>(&rect[Engine::RASTER_HALFSPACE][y * screen->pitch]);
+    for(int x = x1 - 2; x <= x2 + 2; x++){
+      bool inside = (x >= x1) && (x < x2) && (y >= y1) && (y < y2);
+      if(inside ? ((halfSpace[x] == clear) || (halfSpace[x] != scanline[x])) : (halfSpace[x] != clear))
+        wrong++;
+    }
+  }
+  if(wrong){
+    std::cout << "top-left rule: " << wrong << " pixels around rectangle differ" << std::endl;
+    failed++;
+  }
+
+  //Level over memory budget is refused and reported once
+  FractalPyramid pyramid;
+  pyramid.setMemoryBudget(1);
+  pyramid.addLevel();
+  std::string notice = pyramid.takeNotice();
+  if((pyramid.getLevel() != 1) || notice.empty() || !pyramid.takeNotice().empty()){
+    std::cout << "memory budget: level " << pyramid.getLevel() << ", notice \"" << notice
+              << "\", expected level 1 and one notice" << std::endl;
+    failed++;
+  }
+
+  std::cout << (failed ? "Self test failed" : "Self test passed") << std::endl;
+  return failed ? 1 : 0;
+}
+
+/** Run Benchmark
+* Parse benchmark options, run camera path and write results as JSON
+* @param argc Number of arguments
+* @param argv Arguments, first two are program name and --benchmark
+* @return Exit code
+*/
+int runBenchmark(int argc, char* argv[]){
+  BenchmarkConfig_t config;
+  config.figure = Engine::BUTTON_CUBE;
+  config.level = 3;
+  config.frames = 500;
+  config.warmup = 20;
+  config.renderMode = Engine::RENDER_FILLED;
+  config.width = 800;
+  config.height = 600;
+  config.bpp = 32;
+  config.headless = false;
+  config.implicit = false;
+  config.lod = 0.0f;
+  config.zoom = 0.0f;
+  config.memory = 0;
+
+  int threads = 0;
+  int pipeline = 1;
+  int rasterizer = Engine::RASTER_SCANLINE;
+  const char* output = 0;
+  const char* trace = 0;
+  const char* dump = 0;
+  bool profile = false;
+  bool counters = false;
+
+  for(int i = 2; i < argc; i++){
+    bool hasValue = (i + 1 < argc);
+    if(strcmp(argv[i], "--headless") == 0)
+      config.headless = true;
+    else if(strcmp(argv[i], "--implicit") == 0)
+      config.implicit = true;
+    else if((strcmp(argv[i], "--lod") == 0) && hasValue)
+      config.lod = static_cast<float>(atof(argv[++i]));
+    else if((strcmp(argv[i], "--zoom") == 0) && hasValue)
+      config.zoom = static_cast<float>(atof(argv[++i]));
+    else if((strcmp(argv[i], "--memory") == 0) && hasValue)
+      config.memory = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--lines") == 0)
+      config.renderMode = Engine::RENDER_LINES;
+    else if((strcmp(argv[i], "--figure") == 0) && hasValue)
+      config.figure = (strcmp(argv[++i], "pyramid") == 0) ? Engine::BUTTON_PYRAMID : Engine::BUTTON_CUBE;
+    else if((strcmp(argv[i], "--level") == 0) && hasValue)
+      config.level = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--frames") == 0) && hasValue)
+      config.frames = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--warmup") == 0) && hasValue)
+      config.warmup = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--width") == 0) && hasValue)
+      config.width = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--height") == 0) && hasValue)
+      config.height = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--bpp") == 0) && hasValue)
+      config.bpp = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--threads") == 0) && hasValue)
+      threads = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--pipeline") == 0) && hasValue)
+      pipeline = atoi(argv[++i]);
+    else if((strcmp(argv[i], "--rasterizer") == 0) && hasValue)
+      rasterizer = (strcmp(argv[++i], "halfspace") == 0) ? Engine::RASTER_HALFSPACE : Engine::RASTER_SCANLINE;
+    else if((strcmp(argv[i], "--output") == 0) && hasValue)
+      output = argv[++i];
+    else if((strcmp(argv[i], "--trace") == 0) && hasValue)
+      trace = argv[++i];
+    else if((strcmp(argv[i], "--dump") == 0) && hasValue)
+      dump = argv[++i];
+    else if(strcmp(argv[i], "--profile") == 0)
+      profile = true;
+    else if(strcmp(argv[i], "--counters") == 0)
+      profile = counters = true;
+    else{
+      std::cout << "Usage: " << argv[0] << " --benchmark [--figure cube|pyramid] [--level N]"
+                << " [--frames N] [--warmup N] [--width N] [--height N] [--bpp N] [--headless] [--implicit] [--lod PIXELS] [--zoom DISTANCE] [--memory MB]"
+                << " [--lines] [--threads N] [--pipeline N] [--rasterizer scanline|halfspace] [--output FILE]"
+                << " [--trace FILE] [--dump FILE.ppm|FILE.bmp] [--profile] [--counters]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  Backend* backend;
+  if(config.headless)
+    backend = new HeadlessBackend(config.width, config.height, config.bpp);
+  else
+    backend = new WindowBackend(config.width, config.height, config.bpp, false);
+
+  Engine sk(backend);
+  if(threads > 0)
+    sk.setRasterThreads(threads);
+  sk.setPipelineDepth(pipeline);
+  sk.setRasterizer(rasterizer);
+
+  int board = createBoard(sk, config.figure);
+
+  //Zones of measured frames go to trace and report
+  if(trace || profile)
+    Profiler::getInstance().setEnabled(true);
+  Profiler::getInstance().setCountersEnabled(counters);
+
+  Benchmark benchmark(sk, config);
+  benchmark.run(board);
+
+  //Last shown frame, as BMP if file name asks for it, PPM otherwise
+  if(dump){
+    std::string name(dump);
+    if((name.size() > 4) && (name.compare(name.size() - 4, 4, ".bmp") == 0))
+      backend->saveBMP(name);
+    else
+      backend->savePPM(name);
+  }
+
+  if(trace)
+    Profiler::getInstance().exportTrace(trace);
+
+  //Report goes to stderr, stdout may carry JSON
+  if(profile)
+    Profiler::getInstance().printOnce(std::cerr);
+
+  if(output){
+    std::ofstream file(output);
+    if(!file)
+      throw Exception(std::string("Cannot open ") + output);
+    benchmark.writeJson(file);
+  }else{
+    benchmark.writeJson(std::cout);
+  }
+
+  return 0;
 }
 
 int main(int argc, char* argv[])
 {
   try{
+    //Benchmark mode, runs camera path and exits
+    if((argc > 1) && (strcmp(argv[1], "--benchmark") == 0))
+      return runBenchmark(argc, argv);
+
+    //Engine checks, run headless and exit
+    if((argc > 1) && (strcmp(argv[1], "--selftest") == 0))
+      return runSelfTest();
+
+    //Trace of whole session, P key switches recording in game
+    const char* trace = 0;
+    //Pipelining adds latency of depth-1 frames to input, it is opt-in
+    int pipeline = 1;
+    for(int i = 1; i < argc; i++) {
+      bool hasValue = (i + 1 < argc);
+      if((strcmp(argv[i], "--trace") == 0) && hasValue) {
+        trace = argv[++i];
+        Profiler::getInstance().setEnabled(true);
+      }else if((strcmp(argv[i], "--pipeline") == 0) && hasValue)
+        pipeline = atoi(argv[++i]);
+    }
 
     Engine sk(800, 600, 32);  //Initialize engine
+    sk.setFramePacing(Engine::PACING_TARGET, 60);
+    sk.setPipelineDepth(pipeline);
     Fractal* fractal = NULL;
     SDL_Event event;  //Event queue
 
@@ -75,6 +439,10 @@ int main(int argc, char* argv[])
 
     srand(time(NULL));
 
+    //Boards never change, create them once
+    int cubeBoard = createBoard(sk, Engine::BUTTON_CUBE);
+    int pyramidBoard = createBoard(sk, Engine::BUTTON_PYRAMID);
+
     //Main loop
     while(sk.isRunning()) {
       while(SDL_PollEvent(&event)) {
@@ -84,7 +452,10 @@ int main(int argc, char* argv[])
 
         //Cube button pressed create cube
         if((!fractal) && (button == Engine::BUTTON_CUBE)){
-          fractal = new FractalCube;
+          FractalCube* cube = new FractalCube;
+          cube->setLodThreshold(cLodThreshold);
+          cube->setRenderer(sk);
+          fractal = cube;
           ax = ay = az = 0.0f;
           x = y = z = 0.0f;
         }
@@ -92,6 +463,7 @@ int main(int argc, char* argv[])
         //Pyramid button pressed create pyramid
         if((!fractal) && (button == Engine::BUTTON_PYRAMID)){
           fractal = new FractalPyramid;
+          fractal->setRenderer(sk);
           ax = ay = az = 0.0f;
           x = y = z = 0.0f;
         }
@@ -102,10 +474,19 @@ int main(int argc, char* argv[])
           fractal = NULL;
         }
 
-        //Handle fractatl's input
-        if(fractal)
+        //Handle fractatl's input, levels that did not fit memory are reported
+        if(fractal) {
           fractal->handleInput(event);
 
+          std::string notice = fractal->takeNotice();
+          if(!notice.empty())
+            std::cerr << notice << std::endl;
+        }
+
+        //Draw rarely while minimized
+        if((event.type == SDL_ACTIVEEVENT) && (event.active.state & SDL_APPACTIVE))
+          sk.setFramePacing(event.active.gain ? Engine::PACING_TARGET : Engine::PACING_IDLE, 60);
+
         //Handle other input
         if(event.type == SDL_KEYDOWN) {
           if(event.key.keysym.sym == SDLK_LEFT)
@@ -144,35 +525,50 @@ int main(int argc, char* argv[])
       if(az > 359.0f) az = 0.0f;
       if(az < 0.0f) az = 359.0f;
 
-      //Clear screen, zbuffer
-      sk.clearScreen();
-      sk.clearZbuffer();
+      {
+        ProfileZone frameZone(cZoneFrame);
+
+        //Clear screen, zbuffer
+        sk.clearScreen();
+        sk.clearZbuffer();
 
-      //Load identity matrix, + rotate + translate
-      sk.loadIdentity();
-      sk.translate(x, y, z);
-      sk.rotate(ax, 1, 0, 0);
-      sk.rotate(ay, 0, 1, 0);
-      sk.rotate(az, 0, 0, 1);
+        //Load identity matrix, + rotate + translate
+        sk.loadIdentity();
+        sk.translate(x, y, z);
+        sk.rotate(ax, 1, 0, 0);
+        sk.rotate(ay, 0, 1, 0);
+        sk.rotate(az, 0, 0, 1);
 
-      //Draw board
-      drawBoard(sk, button);
+        //Draw board
+        if(button == Engine::BUTTON_CUBE)
+          sk.drawMesh(cubeBoard);
+        else if(button == Engine::BUTTON_PYRAMID)
+          sk.drawMesh(pyramidBoard);
 
-      //Draw fractal
-      if(fractal)
-        fractal->render(sk);
+        //Draw fractal
+        if(fractal)
+          fractal->render(sk);
 
-      //Update screen
-      sk.updateScreen();
-      SDL_Delay(18);
+        //Update screen, sleeps rest of frame budget
+        sk.updateScreen();
+      }
     }
 
     //Destroy fractal
     if(fractal)
       delete fractal;
+
+    if(trace)
+      Profiler::getInstance().exportTrace(trace);
+
+    //Report of session, unless menu button printed it already
+    #ifdef _DEBUG
+    Profiler::getInstance().printOnce();
+    #endif
   }
   catch(Exception& e){
     std::cout << "Error " << e.what();
+    return 1;
   }
 
   return 0;
@@ -0,0 +1,35 @@
+/**
+* @file Cpu.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of CPU feature detection.
+*/
+
+#include "Cpu.hpp"
+
+bool cpuSupports(int feature)
+{
+  #ifdef CPU_X86
+  #if defined(__GNUC__)
+  __builtin_cpu_init();
+  if(feature == CPU_SSE2)
+    return __builtin_cpu_supports("sse2");
+  if(feature == CPU_AVX2)
+    return __builtin_cpu_supports("avx2");
+  #else
+  int info[4];
+  __cpuid(info, 1);
+  if(feature == CPU_SSE2)
+    return (info[3] & (1 << 26)) != 0;
+  if(feature == CPU_AVX2) {
+    //OS must save ymm registers (osxsave + avx, xcr0 bits 1 and 2)
+    if(((info[2] & (1 << 27)) == 0) || ((info[2] & (1 << 28)) == 0))
+      return false;
+    if((_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+  }
+  #endif
+  #endif
+  return false;
+}
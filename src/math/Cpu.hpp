@@ -0,0 +1,37 @@
+/**
+* @file Cpu.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of CPU feature detection and SIMD helpers.
+* On x86 defines CPU_X86, TARGET_SSE2 and TARGET_AVX2, the target macros
+* let single function use instruction set the file is not compiled for.
+*/
+
+#ifndef CPU_HPP_INCLUDED
+#define CPU_HPP_INCLUDED
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  #define CPU_X86
+  #define TARGET_SSE2 __attribute__((target("sse2")))
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+  #include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  #define CPU_X86
+  #define TARGET_SSE2
+  #define TARGET_AVX2
+  #include <intrin.h>
+  #include <immintrin.h>
+#endif
+
+/** CPU features. */
+enum{
+  CPU_SSE2,
+  CPU_AVX2
+};
+
+/** Check if CPU and OS support feature.
+* @param feature Feature to check.
+* @return true if feature is supported.
+*/
+bool cpuSupports(int feature);
+
+#endif // CPU_HPP_INCLUDED
@@ -166,3 +166,8 @@ Vector Matrix::operator *(const Vector& rhs) const
                 _m[1] * rhs[0] + _m[5] * rhs[1] + _m[ 9] * rhs[2] + _m[13] * rhs[3],
                 _m[2] * rhs[0] + _m[6] * rhs[1] + _m[10] * rhs[2] + _m[14] * rhs[3]);
 }
+
+const float* Matrix::data() const
+{
+  return _m;
+}
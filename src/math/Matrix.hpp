@@ -81,6 +81,9 @@ class Matrix{
     Vector operator *(const Vector& rhs) const;
     /** @} */
 
+    /** @return Raw column major matrix values, no bounds checking. */
+    const float* data() const;
+
   private:
     float _m[cMatrixSize]; /**< The matrix it self. */
 };
@@ -0,0 +1,145 @@
+/**
+* @file Transform.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of batch vertex transform.
+*/
+
+#include "Transform.hpp"
+#include "Cpu.hpp"
+
+typedef void (*TransformFunc)(const float*, const float*, const float*, const float*,
+                              float*, float*, float*, int);
+
+/* All kernels evaluate ((m0 * x + m4 * y) + m8 * z) + m12 with separate
+* multiply and add, no fused multiply add, so every kernel rounds the same
+* way and output is bit identical. Scalar kernel must not be contracted
+* into fma when compiler targets cpu with fma. */
+#if defined(__GNUC__) && !defined(__clang__)
+  #pragma GCC optimize("fp-contract=off")
+#elif defined(__clang__)
+  #pragma STDC FP_CONTRACT OFF
+#elif defined(_MSC_VER)
+  #pragma fp_contract(off)
+#endif
+
+static void transformScalar(const float* m, const float* x, const float* y, const float* z,
+                            float* ox, float* oy, float* oz, int count)
+{
+  for(int i = 0; i < count; i++) {
+    float px = x[i], py = y[i], pz = z[i];
+    ox[i] = m[0] * px + m[4] * py + m[ 8] * pz + m[12];
+    oy[i] = m[1] * px + m[5] * py + m[ 9] * pz + m[13];
+    oz[i] = m[2] * px + m[6] * py + m[10] * pz + m[14];
+  }
+}
+
+#ifdef CPU_X86
+TARGET_SSE2
+static void transformSSE2(const float* m, const float* x, const float* y, const float* z,
+                          float* ox, float* oy, float* oz, int count)
+{
+  __m128 m0 = _mm_set1_ps(m[0]), m4 = _mm_set1_ps(m[4]), m8  = _mm_set1_ps(m[ 8]), m12 = _mm_set1_ps(m[12]);
+  __m128 m1 = _mm_set1_ps(m[1]), m5 = _mm_set1_ps(m[5]), m9  = _mm_set1_ps(m[ 9]), m13 = _mm_set1_ps(m[13]);
+  __m128 m2 = _mm_set1_ps(m[2]), m6 = _mm_set1_ps(m[6]), m10 = _mm_set1_ps(m[10]), m14 = _mm_set1_ps(m[14]);
+
+  int i = 0;
+  for(; i + 4 <= count; i += 4) {
+    __m128 px = _mm_loadu_ps(x + i);
+    __m128 py = _mm_loadu_ps(y + i);
+    __m128 pz = _mm_loadu_ps(z + i);
+
+    __m128 rx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m4, py)), _mm_mul_ps(m8, pz)), m12);
+    __m128 ry = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m5, py)), _mm_mul_ps(m9, pz)), m13);
+    __m128 rz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, px), _mm_mul_ps(m6, py)), _mm_mul_ps(m10, pz)), m14);
+
+    _mm_storeu_ps(ox + i, rx);
+    _mm_storeu_ps(oy + i, ry);
+    _mm_storeu_ps(oz + i, rz);
+  }
+
+  transformScalar(m, x + i, y + i, z + i, ox + i, oy + i, oz + i, count - i);
+}
+
+TARGET_AVX2
+static void transformAVX2(const float* m, const float* x, const float* y, const float* z,
+                          float* ox, float* oy, float* oz, int count)
+{
+  __m256 m0 = _mm256_set1_ps(m[0]), m4 = _mm256_set1_ps(m[4]), m8  = _mm256_set1_ps(m[ 8]), m12 = _mm256_set1_ps(m[12]);
+  __m256 m1 = _mm256_set1_ps(m[1]), m5 = _mm256_set1_ps(m[5]), m9  = _mm256_set1_ps(m[ 9]), m13 = _mm256_set1_ps(m[13]);
+  __m256 m2 = _mm256_set1_ps(m[2]), m6 = _mm256_set1_ps(m[6]), m10 = _mm256_set1_ps(m[10]), m14 = _mm256_set1_ps(m[14]);
+
+  int i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m256 px = _mm256_loadu_ps(x + i);
+    __m256 py = _mm256_loadu_ps(y + i);
+    __m256 pz = _mm256_loadu_ps(z + i);
+
+    __m256 rx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, px), _mm256_mul_ps(m4, py)), _mm256_mul_ps(m8, pz)), m12);
+    __m256 ry = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m1, px), _mm256_mul_ps(m5, py)), _mm256_mul_ps(m9, pz)), m13);
+    __m256 rz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m2, px), _mm256_mul_ps(m6, py)), _mm256_mul_ps(m10, pz)), m14);
+
+    _mm256_storeu_ps(ox + i, rx);
+    _mm256_storeu_ps(oy + i, ry);
+    _mm256_storeu_ps(oz + i, rz);
+  }
+
+  transformSSE2(m, x + i, y + i, z + i, ox + i, oy + i, oz + i, count - i);
+}
+#endif
+
+static bool kernelSupported(int kernel)
+{
+  if(kernel == TRANSFORM_SSE2)
+    return cpuSupports(CPU_SSE2);
+  if(kernel == TRANSFORM_AVX2)
+    return cpuSupports(CPU_AVX2);
+  return (kernel == TRANSFORM_SCALAR);
+}
+
+static TransformFunc kernelFunc(int kernel)
+{
+  #ifdef CPU_X86
+  if(kernel == TRANSFORM_AVX2)
+    return transformAVX2;
+  if(kernel == TRANSFORM_SSE2)
+    return transformSSE2;
+  #endif
+  return transformScalar;
+}
+
+static int currentKernel = -1; /**< Selected kernel, -1 until first use. */
+static TransformFunc currentFunc = transformScalar; /**< Selected kernel function. */
+
+int detectTransformKernel()
+{
+  if(kernelSupported(TRANSFORM_AVX2))
+    return TRANSFORM_AVX2;
+  if(kernelSupported(TRANSFORM_SSE2))
+    return TRANSFORM_SSE2;
+  return TRANSFORM_SCALAR;
+}
+
+int getTransformKernel()
+{
+  if(currentKernel < 0)
+    setTransformKernel(detectTransformKernel());
+  return currentKernel;
+}
+
+void setTransformKernel(int kernel)
+{
+  if(!kernelSupported(kernel))
+    kernel = detectTransformKernel();
+
+  currentKernel = kernel;
+  currentFunc = kernelFunc(kernel);
+}
+
+void transformPoints(const float m[cMatrixSize], const float* x, const float* y, const float* z,
+                     float* ox, float* oy, float* oz, int count)
+{
+  if(currentKernel < 0)
+    setTransformKernel(detectTransformKernel());
+
+  currentFunc(m, x, y, z, ox, oy, oz, count);
+}
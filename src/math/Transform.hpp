@@ -0,0 +1,43 @@
+/**
+* @file Transform.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of batch vertex transform.
+* Points are passed as structure of arrays and multiplied by 4x4 column
+* major matrix with w = 1. SIMD kernels are selected at runtime by CPU
+* features and give the same result as the scalar kernel.
+*/
+
+#ifndef TRANSFORM_HPP_INCLUDED
+#define TRANSFORM_HPP_INCLUDED
+
+#include "Matrix.hpp"
+
+/** Transform kernels. */
+enum{
+  TRANSFORM_SCALAR,
+  TRANSFORM_SSE2,
+  TRANSFORM_AVX2
+};
+
+/** Transform batch of points.
+* @param m Column major matrix.
+* @param x/y/z Input coordinates.
+* @param ox/oy/oz Output coordinates, must not overlap input.
+* @param count Number of points.
+*/
+void transformPoints(const float m[cMatrixSize], const float* x, const float* y, const float* z,
+                     float* ox, float* oy, float* oz, int count);
+
+/** @return Best kernel supported by this CPU. */
+int detectTransformKernel();
+
+/** @return Kernel used by transformPoints. */
+int getTransformKernel();
+
+/** Force kernel used by transformPoints, falls back to best supported one
+* if CPU does not support requested kernel.
+* @param kernel Kernel to use.
+*/
+void setTransformKernel(int kernel);
+
+#endif // TRANSFORM_HPP_INCLUDED
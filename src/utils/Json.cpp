@@ -0,0 +1,29 @@
+/**
+* @file Json.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of JSON writing helpers.
+*/
+
+#include <iomanip>
+
+#include "Json.hpp"
+
+void writeJsonString(std::ostream& out, const std::string& text)
+{
+  out << '"';
+  for(unsigned int i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if((c == '"') || (c == '\\'))
+      out << '\\' << c;
+    else if(c == '\n')
+      out << "\\n";
+    else if(c == '\t')
+      out << "\\t";
+    else if(c < 0x20)
+      out << "\\u00" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(c)
+          << std::dec << std::setfill(' ');
+    else
+      out << c;
+  }
+  out << '"';
+}
@@ -0,0 +1,19 @@
+/**
+* @file Json.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of JSON writing helpers.
+*/
+
+#ifndef JSON_HPP_INCLUDED
+#define JSON_HPP_INCLUDED
+
+#include <string>
+#include <iostream>
+
+/** Write text as JSON string, quotes, backslashes and control characters are escaped.
+* @param out Stream to write to.
+* @param text Text to write.
+*/
+void writeJsonString(std::ostream& out, const std::string& text);
+
+#endif // JSON_HPP_INCLUDED
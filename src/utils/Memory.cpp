@@ -0,0 +1,53 @@
+/**
+* @file Memory.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of aligned memory helpers.
+*/
+
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Memory.hpp"
+#include "Exception.hpp"
+
+void* alignedMalloc(size_t size, size_t alignment)
+{
+  //Keep original pointer right before the aligned block
+  char* raw = static_cast<char*>(malloc(size + alignment + sizeof(void*)));
+  if(raw == 0)
+    throw Exception("Cannot allocate memory");
+
+  size_t addr = reinterpret_cast<size_t>(raw + sizeof(void*));
+  char* aligned = reinterpret_cast<char*>((addr + alignment - 1) & ~(alignment - 1));
+  reinterpret_cast<void**>(aligned)[-1] = raw;
+
+  return aligned;
+}
+
+void alignedFree(void* p)
+{
+  if(p)
+    free(reinterpret_cast<void**>(p)[-1]);
+}
+
+Uint64 getPhysicalMemory()
+{
+  #ifdef _WIN32
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if(!GlobalMemoryStatusEx(&status))
+    return 0;
+  return status.ullTotalPhys;
+  #else
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if((pages <= 0) || (pageSize <= 0))
+    return 0;
+  return static_cast<Uint64>(pages) * pageSize;
+  #endif
+}
@@ -0,0 +1,31 @@
+/**
+* @file Memory.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of aligned memory helpers.
+*/
+
+#ifndef MEMORY_HPP_INCLUDED
+#define MEMORY_HPP_INCLUDED
+
+#include <cstddef>
+
+#include <SDL/SDL.h>
+
+const size_t cCacheLineSize = 64; /**< Cache line size in bytes. */
+
+/** Allocate aligned memory.
+* @param size Size in bytes.
+* @param alignment Alignment in bytes, power of two.
+* @return Pointer to memory, must be freed with alignedFree.
+*/
+void* alignedMalloc(size_t size, size_t alignment = cCacheLineSize);
+
+/** Free memory allocated with alignedMalloc.
+* @param p Pointer to free, may be 0.
+*/
+void alignedFree(void* p);
+
+/** @return Physical memory of machine in bytes, 0 if it is not known. */
+Uint64 getPhysicalMemory();
+
+#endif // MEMORY_HPP_INCLUDED
@@ -0,0 +1,125 @@
+/**
+* @file PerfCounters.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of PerfCounters class.
+*/
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#endif
+
+#include "PerfCounters.hpp"
+
+#ifdef __linux__
+//Counter of calling thread on any cpu, user space only so it works with
+//default perf_event_paranoid
+static int openCounter(Uint32 type, Uint64 config, int group)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+  _numOpened = 0;
+  for(int i = 0; i < cPerfCounters; i++)
+    _fd[i] = _index[i] = -1;
+
+  #ifdef __linux__
+  Uint32 types[cPerfCounters] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+  };
+  Uint64 configs[cPerfCounters] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+
+  //Cycles lead the group, other counters are optional
+  _fd[PERF_CYCLES] = openCounter(types[PERF_CYCLES], configs[PERF_CYCLES], -1);
+  if(_fd[PERF_CYCLES] < 0) {
+    _error = std::string("perf_event_open failed: ") + strerror(errno);
+    return;
+  }
+  _index[PERF_CYCLES] = _numOpened++;
+
+  for(int i = PERF_INSTRUCTIONS; i < cPerfCounters; i++) {
+    _fd[i] = openCounter(types[i], configs[i], _fd[PERF_CYCLES]);
+    if(_fd[i] >= 0)
+      _index[i] = _numOpened++;
+  }
+  #else
+  _error = "Hardware counters are supported only on Linux";
+  #endif
+}
+
+PerfCounters::~PerfCounters()
+{
+  #ifdef __linux__
+  for(int i = cPerfCounters - 1; i >= 0; i--) {
+    if(_fd[i] >= 0)
+      close(_fd[i]);
+  }
+  #endif
+}
+
+bool PerfCounters::isAvailable() const
+{
+  return _numOpened > 0;
+}
+
+bool PerfCounters::hasCounter(int counter) const
+{
+  return _index[counter] >= 0;
+}
+
+const std::string& PerfCounters::getError() const
+{
+  return _error;
+}
+
+bool PerfCounters::read(Uint64* values) const
+{
+  for(int i = 0; i < cPerfCounters; i++)
+    values[i] = 0;
+
+  #ifdef __linux__
+  if(!_numOpened)
+    return false;
+
+  //Group read returns number of counters followed by their values
+  Uint64 group[1 + cPerfCounters];
+  ssize_t size = sizeof(Uint64) * (1 + _numOpened);
+  if(::read(_fd[PERF_CYCLES], group, size) != size)
+    return false;
+
+  for(int i = 0; i < cPerfCounters; i++) {
+    if(_index[i] >= 0)
+      values[i] = group[1 + _index[i]];
+  }
+  return true;
+  #else
+  return false;
+  #endif
+}
+
+const char* PerfCounters::getName(int counter)
+{
+  static const char* names[cPerfCounters] = {"Cycles", "Instructions", "L1D misses", "LLC misses", "Branch misses"};
+  return names[counter];
+}
@@ -0,0 +1,61 @@
+/**
+* @file PerfCounters.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of PerfCounters class.
+* Hardware performance counters of calling thread, read through Linux
+* perf_event_open. On other systems, or when kernel refuses access,
+* counters are reported unavailable.
+*/
+
+#ifndef PERFCOUNTERS_HPP_INCLUDED
+#define PERFCOUNTERS_HPP_INCLUDED
+
+#include <string>
+
+#include <SDL/SDL.h>
+
+const int cPerfCounters = 5; /**< Number of counters. */
+
+class PerfCounters{
+  public:
+    enum {PERF_CYCLES = 0, PERF_INSTRUCTIONS, PERF_L1_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES};
+
+    /** Open counters of calling thread, they count only while it runs. */
+    PerfCounters();
+
+    /** Close counters. */
+    ~PerfCounters();
+
+    /** @return true if at least cycles are counted. */
+    bool isAvailable() const;
+
+    /** @return true if counter is counted.
+    * @param counter Counter.
+    */
+    bool hasCounter(int counter) const;
+
+    /** @return Reason counters are not available. */
+    const std::string& getError() const;
+
+    /** Read all counters at once.
+    * @param values cPerfCounters values, missing counters read 0.
+    * @return false if counters could not be read.
+    */
+    bool read(Uint64* values) const;
+
+    /** @return Counter name.
+    * @param counter Counter.
+    */
+    static const char* getName(int counter);
+
+  private:
+    PerfCounters(const PerfCounters&);
+    PerfCounters& operator=(const PerfCounters&);
+
+    int _fd[cPerfCounters]; /**< File of every counter, -1 if not counted. */
+    int _index[cPerfCounters]; /**< Position of counter in group read, -1 if not counted. */
+    int _numOpened; /**< Counters in group. */
+    std::string _error; /**< Reason counters are not available. */
+};
+
+#endif // PERFCOUNTERS_HPP_INCLUDED
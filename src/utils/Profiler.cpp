@@ -4,87 +4,582 @@
 * @brief Realization of Profiler class.
 */
 
-#include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
 
-#include <SDL/SDL.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "Profiler.hpp"
+#include "Exception.hpp"
+#include "Json.hpp"
+
+//Thread local storage and compiler/memory barrier, data must be written
+//before the index publishing it and read after it
+#ifdef _MSC_VER
+#define PROFILER_THREAD __declspec(thread)
+#define PROFILER_BARRIER() _ReadWriteBarrier()
+#elif defined(__i386__) || defined(__x86_64__)
+#define PROFILER_THREAD __thread
+#define PROFILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define PROFILER_THREAD __thread
+#define PROFILER_BARRIER() __sync_synchronize()
+#endif
+
+const Uint32 cProfileBufferSize = 1 << 16; /**< Events kept per thread, power of two. */
+const int cMaxProfileNodes = 256; /**< Call tree size limit. */
+const int cMaxProfileDepth = 32; /**< Zones open at once on one thread. */
+const int cProfileSubBuckets = 8; /**< Histogram buckets per power of two, 12.5% precision. */
+const int cProfileBuckets = 40 * cProfileSubBuckets; /**< Histogram buckets, up to 2^42 ns. */
+
+static PROFILER_THREAD ProfileBuffer_t* tlsBuffer = 0; /**< Buffer of current thread. */
+
+//Debug builds profile from start as before, release only when asked
+#ifdef _DEBUG
+volatile bool Profiler::_enabled = true;
+#else
+volatile bool Profiler::_enabled = false;
+#endif
+
+//Index of highest set bit, value must not be 0
+static int highestBit(Uint64 value)
+{
+  int bit = 0;
+  for(int shift = 32; shift > 0; shift >>= 1) {
+    if(value >> shift) {
+      value >>= shift;
+      bit += shift;
+    }
+  }
+  return bit;
+}
+
+//Times below 8 ns get own bucket, others 8 buckets per power of two
+static int getBucket(Uint64 time)
+{
+  if(time < cProfileSubBuckets)
+    return static_cast<int>(time);
+
+  int bit = highestBit(time);
+  int bucket = (bit - 2) * cProfileSubBuckets + static_cast<int>((time >> (bit - 3)) & (cProfileSubBuckets - 1));
+  return std::min(bucket, cProfileBuckets - 1);
+}
+
+//Smallest time of bucket
+static Uint64 getBucketStart(int bucket)
+{
+  if(bucket < cProfileSubBuckets)
+    return bucket;
+
+  int bit = bucket / cProfileSubBuckets + 2;
+  return static_cast<Uint64>(cProfileSubBuckets + bucket % cProfileSubBuckets) << (bit - 3);
+}
+
+//Middle time of bucket
+static Uint64 getBucketValue(int bucket)
+{
+  return (getBucketStart(bucket) + getBucketStart(bucket + 1)) / 2;
+}
+
+//Nearest rank percentile of histogram
+static Uint64 getPercentile(const ProfileStats_t& stats, double percent)
+{
+  if(stats.calls == 0)
+    return 0;
+
+  Uint64 rank = static_cast<Uint64>(percent / 100.0 * stats.calls + 0.999999);
+  if(rank < 1)
+    rank = 1;
+
+  Uint64 count = 0;
+  for(int i = 0; i < cProfileBuckets; i++) {
+    count += stats.histogram[i];
+    if(count >= rank)
+      return getBucketValue(i);
+  }
+  return getBucketValue(cProfileBuckets - 1);
+}
+
+//Largest recorded time, within bucket precision
+static Uint64 getMax(const ProfileStats_t& stats)
+{
+  for(int i = cProfileBuckets - 1; i >= 0; i--) {
+    if(stats.histogram[i])
+      return getBucketStart(i + 1) - 1;
+  }
+  return 0;
+}
+
+//to += from * sign
+static void addStats(ProfileStats_t& to, const ProfileStats_t& from, int sign)
+{
+  to.calls += sign * from.calls;
+  to.inclusive += sign * from.inclusive;
+  to.exclusive += sign * from.exclusive;
+  for(int i = 0; i < cProfileBuckets; i++)
+    to.histogram[i] += sign * from.histogram[i];
+  to.counted += sign * from.counted;
+  for(int i = 0; i < cPerfCounters; i++)
+    to.counters[i] += sign * from.counters[i];
+}
+
+//Zero stats, histogram stays allocated
+static void resetStats(ProfileStats_t& stats)
+{
+  stats.calls = stats.inclusive = stats.exclusive = stats.counted = 0;
+  memset(stats.histogram, 0, sizeof(Uint32) * cProfileBuckets);
+  for(int i = 0; i < cPerfCounters; i++)
+    stats.counters[i] = 0;
+}
+
+static bool eventEarlier(const ProfileEvent_t& a, const ProfileEvent_t& b)
+{
+  return a.start < b.start;
+}
+
+Profiler& Profiler::getInstance()
+{
+  //Created on first use, zones are registered during static initialization
+  static Profiler instance;
+  return instance;
+}
 
 Profiler::Profiler()
 {
+  _mutex = SDL_CreateMutex();
   _saved = false;
+
+  _countersEnabled = false;
+  for(int i = 0; i < cPerfCounters; i++)
+    _hasCounter[i] = false;
+
+  _nodes = new ProfileNode_t[cMaxProfileNodes];
+  _nodes[0].zone = -1;
+  _nodes[0].parent = -1;
+  _nodes[0].counters = false;
+  _nodes[0].firstChild = -1;
+  _nodes[0].nextSibling = -1;
+  _numNodes = 1;
+
+  _cleared = new ProfileStats_t[cMaxProfileNodes];
+  Uint32* histograms = new Uint32[cMaxProfileNodes * cProfileBuckets];
+  for(int i = 0; i < cMaxProfileNodes; i++) {
+    _cleared[i].histogram = histograms + i * cProfileBuckets;
+    resetStats(_cleared[i]);
+  }
 }
 
 Profiler::~Profiler()
 {
+  for(unsigned int i = 0; i < _buffers.size(); i++) {
+    delete[] _buffers[i]->events;
+    delete[] _buffers[i]->nodes;
+    delete[] _buffers[i]->childTime;
+    delete[] _buffers[i]->counted;
+    delete[] _buffers[i]->counterStart;
+    delete _buffers[i]->perf;
+    delete[] _buffers[i]->stats[0].histogram;
+    delete[] _buffers[i]->stats;
+    delete _buffers[i];
+  }
+  delete[] _cleared[0].histogram;
+  delete[] _cleared;
+  delete[] _nodes;
+  SDL_DestroyMutex(_mutex);
+}
+
+void Profiler::setEnabled(bool enabled)
+{
+  _enabled = enabled;
+}
+
+void Profiler::setCountersEnabled(bool enabled)
+{
+  _countersEnabled = enabled;
+}
+
+int Profiler::registerZone(const char* name, bool counters)
+{
+  SDL_mutexP(_mutex);
+  int zone = std::find(_zones.begin(), _zones.end(), name) - _zones.begin();
+  if(zone == static_cast<int>(_zones.size())) {
+    _zones.push_back(name);
+    _zoneCounters.push_back(counters);
+  }
+  SDL_mutexV(_mutex);
+
+  return zone;
+}
+
+ProfileBuffer_t* Profiler::getThreadBuffer()
+{
+  ProfileBuffer_t* buffer = tlsBuffer;
+  if(buffer)
+    return buffer;
+
+  //First zone of thread, buffers outlive threads so reports keep their zones
+  buffer = new ProfileBuffer_t;
+  buffer->events = new ProfileEvent_t[cProfileBufferSize];
+  buffer->written = 0;
+  buffer->cleared = 0;
+  buffer->depth = 0;
+  buffer->nodes = new int[cMaxProfileDepth + 1];
+  buffer->nodes[0] = 0;
+  buffer->childTime = new Uint64[cMaxProfileDepth + 1];
+  buffer->childTime[0] = 0;
+  buffer->counted = new bool[cMaxProfileDepth + 1];
+  buffer->counted[0] = false;
+  buffer->counterStart = new Uint64[(cMaxProfileDepth + 1) * cPerfCounters];
+  buffer->perf = 0;
+
+  buffer->stats = new ProfileStats_t[cMaxProfileNodes];
+  Uint32* histograms = new Uint32[cMaxProfileNodes * cProfileBuckets];
+  for(int i = 0; i < cMaxProfileNodes; i++) {
+    buffer->stats[i].histogram = histograms + i * cProfileBuckets;
+    resetStats(buffer->stats[i]);
+  }
+
+  SDL_mutexP(_mutex);
+  _buffers.push_back(buffer);
+  buffer->threadId = _buffers.size();
+  SDL_mutexV(_mutex);
+
+  tlsBuffer = buffer;
+  return buffer;
+}
+
+int Profiler::getNode(int parent, int zone)
+{
+  //Nodes are linked only when complete, so children are searched without lock
+  for(int node = _nodes[parent].firstChild; node >= 0; node = _nodes[node].nextSibling) {
+    if(_nodes[node].zone == zone)
+      return node;
+  }
+
+  SDL_mutexP(_mutex);
+  int node;
+  for(node = _nodes[parent].firstChild; node >= 0; node = _nodes[node].nextSibling) {
+    if(_nodes[node].zone == zone)
+      break;
+  }
+
+  if((node < 0) && (_numNodes < cMaxProfileNodes)) {
+    node = _numNodes;
+    _nodes[node].zone = zone;
+    _nodes[node].parent = parent;
+    _nodes[node].counters = _zoneCounters[zone];
+    _nodes[node].firstChild = -1;
+    _nodes[node].nextSibling = _nodes[parent].firstChild;
+    PROFILER_BARRIER();
+    _nodes[parent].firstChild = node;
+    _numNodes = node + 1;
+  }
+  SDL_mutexV(_mutex);
+
+  return node;
+}
+
+void Profiler::openCounters(ProfileBuffer_t* buffer)
+{
+  buffer->perf = new PerfCounters;
+
+  //Failure is reported once in print, zones keep being timed
+  SDL_mutexP(_mutex);
+  if(buffer->perf->isAvailable()) {
+    for(int i = 0; i < cPerfCounters; i++)
+      _hasCounter[i] = _hasCounter[i] || buffer->perf->hasCounter(i);
+  } else if(_countersError.empty()) {
+    _countersError = buffer->perf->getError();
+  }
+  SDL_mutexV(_mutex);
+}
+
+int Profiler::currentNode()
+{
+  if(!_enabled)
+    return 0;
+
+  ProfileBuffer_t* buffer = getThreadBuffer();
+  return buffer->nodes[buffer->depth];
+}
+
+ProfileBuffer_t* Profiler::beginZone(int zone, int parent)
+{
+  ProfileBuffer_t* buffer = getThreadBuffer();
+  if(buffer->depth >= cMaxProfileDepth)
+    return 0;
+
+  if(parent < 0)
+    parent = buffer->nodes[buffer->depth];
+
+  int node = getNode(parent, zone);
+  if(node < 0)
+    return 0;
+
+  buffer->depth++;
+  buffer->nodes[buffer->depth] = node;
+  buffer->childTime[buffer->depth] = 0;
+  buffer->counted[buffer->depth] = false;
+
+  if(_countersEnabled && _nodes[node].counters) {
+    if(!buffer->perf)
+      openCounters(buffer);
+    if(buffer->perf->isAvailable())
+      buffer->counted[buffer->depth] = buffer->perf->read(buffer->counterStart + buffer->depth * cPerfCounters);
+  }
+  return buffer;
+}
+
+void Profiler::endZone(ProfileBuffer_t* buffer, Uint64 start)
+{
+  Uint64 end = getTimeNs();
+  Uint64 time = end - start;
+
+  int node = buffer->nodes[buffer->depth];
+  ProfileStats_t& stats = buffer->stats[node];
+
+  if(buffer->counted[buffer->depth]) {
+    Uint64 counters[cPerfCounters];
+    const Uint64* start = buffer->counterStart + buffer->depth * cPerfCounters;
+    if(buffer->perf->read(counters)) {
+      stats.counted++;
+      for(int i = 0; i < cPerfCounters; i++)
+        stats.counters[i] += counters[i] - start[i];
+    }
+  }
+
+  Uint64 children = buffer->childTime[buffer->depth];
+  buffer->depth--;
+  buffer->childTime[buffer->depth] += time;
+
+  stats.calls++;
+  stats.inclusive += time;
+  stats.exclusive += (time > children) ? time - children : 0;
+  stats.histogram[getBucket(time)]++;
+
+  Uint32 index = buffer->written;
+  ProfileEvent_t& event = buffer->events[index & (cProfileBufferSize - 1)];
+  event.zone = _nodes[node].zone;
+  event.depth = buffer->depth;
+  event.thread = buffer->threadId;
+  event.start = start;
+  event.end = end;
+
+  PROFILER_BARRIER();
+  buffer->written = index + 1;
+}
+
+void Profiler::clear()
+{
+  SDL_mutexP(_mutex);
+  for(int i = 0; i < cMaxProfileNodes; i++)
+    resetStats(_cleared[i]);
+
+  for(unsigned int i = 0; i < _buffers.size(); i++) {
+    _buffers[i]->cleared = _buffers[i]->written;
+    for(int j = 0; j < _numNodes; j++)
+      addStats(_cleared[j], _buffers[i]->stats[j], 1);
+  }
+  SDL_mutexV(_mutex);
+}
+
+void Profiler::sumStats(std::vector<ProfileStats_t>& stats)
+{
+  for(int i = 0; i < _numNodes; i++) {
+    resetStats(stats[i]);
+
+    for(unsigned int j = 0; j < _buffers.size(); j++)
+      addStats(stats[i], _buffers[j]->stats[i], 1);
+    addStats(stats[i], _cleared[i], -1);
+  }
+}
+
+void Profiler::collect(std::vector<ProfileEvent_t>& events)
+{
+  events.clear();
+
+  for(unsigned int i = 0; i < _buffers.size(); i++) {
+    ProfileBuffer_t* buffer = _buffers[i];
+
+    Uint32 written = buffer->written;
+    PROFILER_BARRIER();
+    Uint32 first = buffer->cleared;
+    if(written - first > cProfileBufferSize)
+      first = written - cProfileBufferSize;
+
+    size_t copied = events.size();
+    for(Uint32 j = first; j != written; j++)
+      events.push_back(buffer->events[j & (cProfileBufferSize - 1)]);
+
+    //Writer could wrap around while copying, drop overwritten events
+    PROFILER_BARRIER();
+    Uint32 now = buffer->written;
+    if(now - first > cProfileBufferSize) {
+      Uint32 lost = std::min(now - first - cProfileBufferSize, written - first);
+      events.erase(events.begin() + copied, events.begin() + copied + lost);
+    }
+  }
+}
+
+void Profiler::exportTrace(const std::string& filename)
+{
+  std::ofstream file(filename.c_str());
+  if(!file)
+    throw Exception("Cannot open " + filename);
+
+  std::vector<ProfileEvent_t> events;
+  SDL_mutexP(_mutex);
+  collect(events);
+  std::vector<std::string> zones = _zones;
+  SDL_mutexV(_mutex);
+
+  std::sort(events.begin(), events.end(), eventEarlier);
+
+  //Times are in microseconds from first zone
+  Uint64 origin = events.empty() ? 0 : events[0].start;
+  int threads = 0;
+
+  file << std::fixed << std::setprecision(3);
+  file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  for(unsigned int i = 0; i < events.size(); i++) {
+    const ProfileEvent_t& e = events[i];
+    file << "{\"name\":";
+    writeJsonString(file, zones[e.zone]);
+    file << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+         << ",\"ts\":" << (e.start - origin) / 1000.0
+         << ",\"dur\":" << (e.end - e.start) / 1000.0 << "},\n";
+    threads = std::max(threads, e.thread);
+  }
+  for(int i = 1; i <= threads; i++) {
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i
+         << ",\"args\":{\"name\":\"Thread " << i << "\"}}" << ((i < threads) ? ",\n" : "\n");
+  }
+  file << "]}\n";
 }
 
-void Profiler::start(const std::string& pfName)
+void Profiler::printNode(std::ostream& out, const std::vector<ProfileStats_t>& stats, int node, int indent)
 {
-  ProfileInfo_t pfInfo;
-  if(_profileMap.find(pfName) == _profileMap.end()) {
-    pfInfo.numIterations = 0;
-    pfInfo.total = 0;
-    pfInfo.current = 0;
-    pfInfo.max = 0;
-    pfInfo.endTime = 0;
-    pfInfo.startTime = SDL_GetTicks();
+  const ProfileStats_t& s = stats[node];
+  if(node > 0) {
+    //Zone was not called since clear, nor were its children
+    if(s.calls == 0)
+      return;
+
+    std::string name = std::string(indent, ' ') + _zones[_nodes[node].zone];
+    out << "| " << std::setw(32) << name
+        << " | " << std::setw(8) << s.calls
+        << " | " << std::setw(12) << nsToMs(s.inclusive)
+        << " | " << std::setw(12) << nsToMs(s.exclusive)
+        << " | " << std::setw(9) << nsToMs(getPercentile(s, 50.0))
+        << " | " << std::setw(9) << nsToMs(getPercentile(s, 95.0))
+        << " | " << std::setw(9) << nsToMs(getPercentile(s, 99.0))
+        << " | " << std::setw(9) << nsToMs(getMax(s))
+        << " |" << std::endl;
+    indent += 2;
   }
 
-  _profileMap.insert(ProfileMapPair(pfName, pfInfo));
+  //Children are linked newest first, print in order of creation
+  std::vector<int> children;
+  for(int child = _nodes[node].firstChild; child >= 0; child = _nodes[child].nextSibling)
+    children.push_back(child);
+
+  for(int i = children.size() - 1; i >= 0; i--)
+    printNode(out, stats, children[i], indent);
 }
 
-void Profiler::stop(const std::string& pfName)
+void Profiler::printCounters(std::ostream& out, const std::vector<ProfileStats_t>& stats, int node, int indent)
 {
-  ProfileMapIter iter = _profileMap.find(pfName);
-  if(iter != _profileMap.end()) {
-    iter->second.endTime = SDL_GetTicks();
-    iter->second.current = iter->second.endTime - iter->second.startTime;
-    iter->second.startTime = iter->second.endTime;
-    iter->second.total += iter->second.current;
-    iter->second.numIterations ++;
-    if(iter->second.current > iter->second.max)
-      iter->second.max = iter->second.current;
-    iter->second.current = 0;
+  const ProfileStats_t& s = stats[node];
+  if(node > 0) {
+    if(s.calls == 0)
+      return;
+
+    //Uncounted zones only keep the tree readable
+    std::string name = std::string(indent, ' ') + _zones[_nodes[node].zone];
+    out << "| " << std::setw(32) << name;
+    for(int i = 0; i < cPerfCounters; i++) {
+      out << " | " << std::setw(14);
+      if(s.counted && _hasCounter[i])
+        out << static_cast<double>(s.counters[i]) / s.counted;
+      else
+        out << "-";
+    }
+    out << " | " << std::setw(6);
+    if(s.counted && _hasCounter[PerfCounters::PERF_INSTRUCTIONS] && s.counters[PerfCounters::PERF_CYCLES])
+      out << static_cast<double>(s.counters[PerfCounters::PERF_INSTRUCTIONS]) / s.counters[PerfCounters::PERF_CYCLES];
+    else
+      out << "-";
+    out << " |" << std::endl;
+    indent += 2;
   }
+
+  std::vector<int> children;
+  for(int child = _nodes[node].firstChild; child >= 0; child = _nodes[child].nextSibling)
+    children.push_back(child);
+
+  for(int i = children.size() - 1; i >= 0; i--)
+    printCounters(out, stats, children[i], indent);
 }
 
-void Profiler::print()
+void Profiler::print(std::ostream& out)
 {
-  if(!_saved) {
-    ProfileMapIter iter;
-    static std::streamsize size = std::cout.width();
-    std::streamsize name = 20, time = 16, niters = 10, maxtime = 16, total = 16;
+  SDL_mutexP(_mutex);
+
+  std::vector<ProfileStats_t> stats(_numNodes);
+  std::vector<Uint32> histograms(_numNodes * cProfileBuckets);
+  for(int i = 0; i < _numNodes; i++)
+    stats[i].histogram = &histograms[i * cProfileBuckets];
+  sumStats(stats);
 
-    std::cout.flags(std::ios::left);
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  out.flags(std::ios::left | std::ios::fixed);
+  out.precision(4);
 
-    std::cout << "| " << std::setw(name) << "Profile Name"
-              << std::setw(size) << " | " << std::setw(time) << "Avg Time(ms)"
-              << std::setw(size) << " | " << std::setw(niters) << "Iters"
-              << std::setw(size) << " | " << std::setw(maxtime) << "Max Time(ms)"
-              << std::setw(size) << " | " << std::setw(total) << "Total Time(ms)"
-              << std::setw(size) << " | " << std::endl;
+  //Total times of zone, percentiles of one call
+  out << "| " << std::setw(32) << "Zone"
+      << " | " << std::setw(8) << "Calls"
+      << " | " << std::setw(12) << "Incl(ms)"
+      << " | " << std::setw(12) << "Excl(ms)"
+      << " | " << std::setw(9) << "p50(ms)"
+      << " | " << std::setw(9) << "p95(ms)"
+      << " | " << std::setw(9) << "p99(ms)"
+      << " | " << std::setw(9) << "Max(ms)"
+      << " |" << std::endl;
 
-    std::cout << "| " << std::setw(name) << " "
-              << std::setw(size) << " | " << std::setw(time) << " "
-              << std::setw(size) << " | " << std::setw(niters) << " "
-              << std::setw(size) << " | " << std::setw(maxtime) << " "
-              << std::setw(size) << " | " << std::setw(total) << " "
-              << std::setw(size) << " | " << std::endl;
+  printNode(out, stats, 0, 0);
 
-    float avg;
-    for(iter = _profileMap.begin(); iter != _profileMap.end(); ++iter) {
-      avg = static_cast<float>(iter->second.total) / static_cast<float>(iter->second.numIterations);
-      std::cout << "| " << std::setw(name) << iter->first
-                << std::setw(size) << " | " << std::setw(time) << avg
-                << std::setw(size) << " | " << std::setw(niters) << iter->second.numIterations
-                << std::setw(size) << " | " << std::setw(maxtime) << iter->second.max
-                << std::setw(size) << " | " << std::setw(total) << iter->second.total
-                << std::setw(size) << " | " << std::endl;
+  //Counters per call, frame zone gives them per frame
+  if(_countersEnabled) {
+    out << std::endl;
+    if(!_countersError.empty()) {
+      out << "Hardware counters unavailable: " << _countersError << std::endl;
+    } else {
+      out.precision(2);
+      out << "| " << std::setw(32) << "Zone";
+      for(int i = 0; i < cPerfCounters; i++)
+        out << " | " << std::setw(14) << PerfCounters::getName(i);
+      out << " | " << std::setw(6) << "IPC" << " |" << std::endl;
+
+      printCounters(out, stats, 0, 0);
     }
-    _saved = true;
   }
+
+  out.flags(flags);
+  out.precision(precision);
+
+  SDL_mutexV(_mutex);
+  _saved = true;
+}
+
+void Profiler::printOnce(std::ostream& out)
+{
+  if(!_saved)
+    print(out);
 }
 
 bool Profiler::saved()
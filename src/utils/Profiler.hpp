@@ -2,46 +2,235 @@
 * @file Profiler.hpp
 * @author Dmitri Koudriavtsev
 * @brief Defenition of Profiler class.
+* Zones are registered once and referenced by id. Opened zones form a call
+* tree, every tree node keeps inclusive and exclusive time and histogram
+* of call times with logarithmic buckets. Zones are timed with nanosecond
+* monotonic clock and recorded by each thread into its own buffers, no
+* locks are taken while recording. Profiler is switched on and off at
+* runtime, disabled zone costs one branch, so zones stay compiled in
+* release builds.
+* Zones registered with counters also read hardware performance counters
+* when counters are switched on, this costs system call on zone open and
+* close, so it is meant for zones lasting microseconds and more.
 */
 
 #ifndef PROFILER_HPP_INCLUDED
 #define PROFILER_HPP_INCLUDED
 
 #include <string>
-#include <map>
+#include <vector>
+#include <iostream>
 
-#include "Manager.hpp"
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
 
+#include "Timer.hpp"
+#include "PerfCounters.hpp"
+
+//Finished zone
+typedef struct{
+  int zone; //Zone id
+  int depth; //Number of zones open around it on the same thread
+  int thread; //Thread id in trace, 1 based
+  Uint64 start; //Start time in nanoseconds
+  Uint64 end; //End time in nanoseconds
+}ProfileEvent_t;
+
+//Call tree node, zone opened inside parent zone
+typedef struct{
+  int zone; //Zone id, -1 for root
+  int parent; //Parent node, -1 for root
+  bool counters; //Zone reads hardware counters
+  volatile int firstChild; //Last created child, -1 if none
+  volatile int nextSibling; //Child of parent created before, -1 if none
+}ProfileNode_t;
+
+//Times of one call tree node
 typedef struct{
-  int startTime;
-  int endTime;
-  int current;
-  int numIterations;
-  int total;
-  int max;
-}ProfileInfo_t;
-
-typedef std::map<std::string, ProfileInfo_t> ProfileMap;
-typedef std::pair<std::string, ProfileInfo_t> ProfileMapPair;
-typedef std::map<std::string, ProfileInfo_t>::iterator ProfileMapIter;
+  Uint64 calls; //Finished calls
+  Uint64 inclusive; //Time including children in nanoseconds
+  Uint64 exclusive; //Time without children on the same thread
+  Uint32* histogram; //Calls by time bucket
+  Uint64 counted; //Calls with hardware counters read
+  Uint64 counters[cPerfCounters]; //Hardware counters summed over counted calls
+}ProfileStats_t;
+
+//Zones of one thread, only the owning thread writes into it
+typedef struct{
+  ProfileEvent_t* events; //Ring of finished zones
+  volatile Uint32 written; //Events ever written, ring position is written % size
+  Uint32 cleared; //Events written before last clear, ignored by readers
+  int depth; //Currently open zones
+  int* nodes; //Open nodes, nodes[0] is root and nodes[depth] innermost
+  Uint64* childTime; //Time of finished children of open nodes
+  bool* counted; //Open node has hardware counters read at open
+  Uint64* counterStart; //Counters at open, cPerfCounters per open node
+  PerfCounters* perf; //Hardware counters of thread, 0 until first counted zone
+  ProfileStats_t* stats; //Stats of every node
+  int threadId; //Thread id in trace, 1 based
+}ProfileBuffer_t;
 
 class Profiler{
   public:
-    Profiler();
-    ~Profiler();
+    /** @return Profiler instance. */
+    static Profiler& getInstance();
+
+    /** @return true if zones are recorded. */
+    static bool isEnabled()
+    {
+      return _enabled;
+    }
+
+    /** Switch recording on or off, zones open while switching are kept.
+    * @param enabled Record zones.
+    */
+    void setEnabled(bool enabled);
+
+    /** Switch reading of hardware counters in zones registered with counters.
+    * @param enabled Read counters.
+    */
+    void setCountersEnabled(bool enabled);
+
+    /** Register zone, done once per zone, usually at static initialization.
+    * @param name Zone name, string literal.
+    * @param counters Zone reads hardware counters.
+    * @return Zone id, same for same name.
+    */
+    int registerZone(const char* name, bool counters = false);
+
+    /** @return Innermost open node of calling thread, root if profiler is disabled. */
+    int currentNode();
+
+    /** Open zone on calling thread.
+    * @param zone Zone id.
+    * @param parent Parent node, -1 for innermost open node of calling thread.
+    * Jobs pass node of thread waiting for them.
+    * @return Buffer of calling thread to pass to endZone, 0 if zone is not recorded.
+    */
+    ProfileBuffer_t* beginZone(int zone, int parent);
+
+    /** Close innermost zone opened by beginZone.
+    * @param buffer Buffer returned by beginZone.
+    * @param start Time zone was opened at.
+    */
+    void endZone(ProfileBuffer_t* buffer, Uint64 start);
+
+    /** Drop all recorded zones and times. */
+    void clear();
+
+    /** Write recorded zones in Chrome trace event format, readable by
+    * chrome://tracing and Perfetto.
+    * Zones finished while writing may be missing from the file.
+    * @param filename File to write.
+    */
+    void exportTrace(const std::string& filename);
 
-    void start(const std::string& pfName);
-    void stop(const std::string& pfName);
+    /** Print call tree with inclusive, exclusive time and percentiles,
+    * followed by hardware counters per call of counted zones.
+    * @param out Stream to print to.
+    */
+    void print(std::ostream& out = std::cout);
 
-    void print();
+    /** Print report unless it was printed already, used on exit.
+    * @param out Stream to print to.
+    */
+    void printOnce(std::ostream& out = std::cout);
 
+    /** @return true if print was called. */
     bool saved();
 
   private:
-    ProfileMap _profileMap;
-    bool _saved;
+    Profiler();
+    ~Profiler();
+
+    Profiler(const Profiler&);
+    Profiler& operator=(const Profiler&);
+
+    /** @return Buffer of calling thread, created on first use. */
+    ProfileBuffer_t* getThreadBuffer();
+
+    /** Find child node of zone, create if missing.
+    * @param parent Parent node.
+    * @param zone Zone id.
+    * @return Node, -1 if there is no room for more nodes.
+    */
+    int getNode(int parent, int zone);
+
+    /** Sum stats of all threads since last clear.
+    * @param stats Stats by node, histograms are allocated by caller.
+    */
+    void sumStats(std::vector<ProfileStats_t>& stats);
+
+    /** Print node and its children.
+    * @param out Stream to print to.
+    * @param stats Stats by node.
+    * @param node Node to print.
+    * @param indent Indentation of zone name.
+    */
+    void printNode(std::ostream& out, const std::vector<ProfileStats_t>& stats, int node, int indent);
+
+    /** Print hardware counters of node and its children.
+    * @param out Stream to print to.
+    * @param stats Stats by node.
+    * @param node Node to print.
+    * @param indent Indentation of zone name.
+    */
+    void printCounters(std::ostream& out, const std::vector<ProfileStats_t>& stats, int node, int indent);
+
+    /** Open hardware counters of thread.
+    * @param buffer Buffer of calling thread.
+    */
+    void openCounters(ProfileBuffer_t* buffer);
+
+    /** Copy events of all threads still present in ring buffers.
+    * @param events Events.
+    */
+    void collect(std::vector<ProfileEvent_t>& events);
+
+    static volatile bool _enabled; /**< Recording switch. */
+
+    std::vector<std::string> _zones; /**< Zone names by id. */
+    std::vector<bool> _zoneCounters; /**< Zone reads hardware counters, by id. */
+    volatile bool _countersEnabled; /**< Hardware counters switch. */
+    bool _hasCounter[cPerfCounters]; /**< Counter was opened by some thread. */
+    std::string _countersError; /**< Reason counters failed to open, empty if they did not. */
+    ProfileNode_t* _nodes; /**< Call tree, nodes are only added. */
+    volatile int _numNodes; /**< Nodes in call tree. */
+    std::vector<ProfileBuffer_t*> _buffers; /**< Buffers of all threads ever recorded. */
+    ProfileStats_t* _cleared; /**< Sum of stats at last clear. */
+    SDL_mutex* _mutex; /**< Guards registration of zones, nodes and buffers. */
+    bool _saved; /**< Report was printed. */
 };
 
-typedef Manager<Profiler> ProfileManager;
+//Times its scope as zone of calling thread
+class ProfileZone{
+  public:
+    /** Open zone.
+    * @param zone Zone id from Profiler::registerZone.
+    * @param parent Parent node, -1 for innermost zone open on this thread.
+    */
+    explicit ProfileZone(int zone, int parent = -1)
+      : _buffer(0), _start(0)
+    {
+      if(Profiler::isEnabled()) {
+        _buffer = Profiler::getInstance().beginZone(zone, parent);
+        _start = getTimeNs();
+      }
+    }
+
+    /** Close zone. */
+    ~ProfileZone()
+    {
+      if(_buffer)
+        Profiler::getInstance().endZone(_buffer, _start);
+    }
+
+  private:
+    ProfileZone(const ProfileZone&);
+    ProfileZone& operator=(const ProfileZone&);
+
+    ProfileBuffer_t* _buffer; /**< Buffer of owning thread, 0 if zone is not recorded. */
+    Uint64 _start; /**< Open time. */
+};
 
 #endif // PROFILER_HPP_INCLUDED
@@ -0,0 +1,141 @@
+/**
+* @file ThreadPool.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of ThreadPool class.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "ThreadPool.hpp"
+#include "Exception.hpp"
+
+ThreadPool::ThreadPool(int numThreads)
+{
+  _func = 0;
+  _data = 0;
+  _count = _next = _done = 0;
+  _generation = 0;
+  _quit = false;
+
+  _mutex = SDL_CreateMutex();
+  _wakeCond = SDL_CreateCond();
+  _doneCond = SDL_CreateCond();
+
+  if((_mutex == 0) || (_wakeCond == 0) || (_doneCond == 0))
+    throw Exception("Cannot create thread pool synchronization objects");
+
+  for(int i = 1; i < numThreads; i++) {
+    SDL_Thread* thread = SDL_CreateThread(workerMain, this);
+    if(thread == 0)
+      break;
+    _threads.push_back(thread);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  SDL_LockMutex(_mutex);
+  _quit = true;
+  SDL_CondBroadcast(_wakeCond);
+  SDL_UnlockMutex(_mutex);
+
+  for(unsigned int i = 0; i < _threads.size(); i++)
+    SDL_WaitThread(_threads[i], 0);
+
+  SDL_DestroyCond(_doneCond);
+  SDL_DestroyCond(_wakeCond);
+  SDL_DestroyMutex(_mutex);
+}
+
+int ThreadPool::size() const
+{
+  return _threads.size() + 1;
+}
+
+void ThreadPool::parallelFor(JobFunc func, void* data, int count)
+{
+  if(count <= 0)
+    return;
+
+  //No workers, run everything here
+  if(_threads.empty()) {
+    for(int i = 0; i < count; i++)
+      func(data, i);
+    return;
+  }
+
+  SDL_LockMutex(_mutex);
+  _func = func;
+  _data = data;
+  _count = count;
+  _next = 0;
+  _done = 0;
+  _generation++;
+  SDL_CondBroadcast(_wakeCond);
+  SDL_UnlockMutex(_mutex);
+
+  runItems();
+
+  SDL_LockMutex(_mutex);
+  while(_done < _count)
+    SDL_CondWait(_doneCond, _mutex);
+  SDL_UnlockMutex(_mutex);
+}
+
+int ThreadPool::workerMain(void* pool)
+{
+  ThreadPool* self = static_cast<ThreadPool*>(pool);
+  int seen = 0;
+
+  SDL_LockMutex(self->_mutex);
+  while(true) {
+    while(!self->_quit && (self->_generation == seen))
+      SDL_CondWait(self->_wakeCond, self->_mutex);
+
+    if(self->_quit)
+      break;
+
+    seen = self->_generation;
+    SDL_UnlockMutex(self->_mutex);
+    self->runItems();
+    SDL_LockMutex(self->_mutex);
+  }
+  SDL_UnlockMutex(self->_mutex);
+
+  return 0;
+}
+
+void ThreadPool::runItems()
+{
+  SDL_LockMutex(_mutex);
+  while(_next < _count) {
+    int index = _next++;
+    JobFunc func = _func;
+    void* data = _data;
+    SDL_UnlockMutex(_mutex);
+
+    func(data, index);
+
+    SDL_LockMutex(_mutex);
+    _done++;
+    if(_done == _count)
+      SDL_CondBroadcast(_doneCond);
+  }
+  SDL_UnlockMutex(_mutex);
+}
+
+int getNumProcessors()
+{
+  #ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int n = info.dwNumberOfProcessors;
+  #else
+  int n = sysconf(_SC_NPROCESSORS_ONLN);
+  #endif
+  return (n > 0) ? n : 1;
+}
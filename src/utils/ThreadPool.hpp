@@ -0,0 +1,69 @@
+/**
+* @file ThreadPool.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of ThreadPool class.
+* Pool of SDL threads running indexed jobs, calling thread takes part
+* in the work too.
+*/
+
+#ifndef THREADPOOL_HPP_INCLUDED
+#define THREADPOOL_HPP_INCLUDED
+
+#include <vector>
+
+#include <SDL/SDL_thread.h>
+
+/** Job function.
+* @param data User data.
+* @param index Index of work item.
+*/
+typedef void (*JobFunc)(void* data, int index);
+
+class ThreadPool{
+  public:
+    /** Create pool.
+    * @param numThreads Number of threads doing the work including the
+    * calling thread, 1 means no worker threads are created.
+    */
+    ThreadPool(int numThreads);
+
+    /** Destructor. Stops all worker threads. */
+    ~ThreadPool();
+
+    /** @return Number of threads doing the work, including calling thread. */
+    int size() const;
+
+    /** Run job on all items and wait until all of them are done.
+    * Items are handed out in increasing order.
+    * @param func Job function.
+    * @param data User data passed to job.
+    * @param count Number of items.
+    */
+    void parallelFor(JobFunc func, void* data, int count);
+
+  private:
+    /** Worker thread entry point. */
+    static int workerMain(void* pool);
+
+    /** Take and run items until there are no more left. */
+    void runItems();
+
+    std::vector<SDL_Thread*> _threads; /**< Worker threads. */
+
+    SDL_mutex* _mutex; /**< Guards all fields below. */
+    SDL_cond* _wakeCond; /**< Signaled when new job posted or pool stops. */
+    SDL_cond* _doneCond; /**< Signaled when all items of job are done. */
+
+    JobFunc _func; /**< Current job. */
+    void* _data; /**< Current job data. */
+    int _count; /**< Number of items in current job. */
+    int _next; /**< Next item to hand out. */
+    int _done; /**< Number of finished items. */
+    int _generation; /**< Incremented for each posted job. */
+    bool _quit; /**< Stop workers. */
+};
+
+/** @return Number of processors available. */
+int getNumProcessors();
+
+#endif // THREADPOOL_HPP_INCLUDED
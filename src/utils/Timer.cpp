@@ -0,0 +1,49 @@
+/**
+* @file Timer.cpp
+* @author Dmitri Koudriavtsev
+* @brief Realization of high resolution timer helpers.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "Timer.hpp"
+
+const Uint64 cSpinNs = 1000000; /**< Time before deadline that is spun instead of slept. */
+
+Uint64 getTimeNs()
+{
+  #ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  if(frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+
+  //Split to avoid overflow of counter * 10^9
+  Uint64 seconds = counter.QuadPart / frequency.QuadPart;
+  Uint64 rest = counter.QuadPart % frequency.QuadPart;
+  return seconds * 1000000000ULL + rest * 1000000000ULL / frequency.QuadPart;
+  #else
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return static_cast<Uint64>(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+  #endif
+}
+
+void sleepUntilNs(Uint64 deadline)
+{
+  Uint64 now = getTimeNs();
+  //Sleep whole milliseconds rounded down, remainder is spun
+  while(now + cSpinNs + 1000000 <= deadline) {
+    SDL_Delay(static_cast<Uint32>((deadline - now - cSpinNs) / 1000000));
+    now = getTimeNs();
+  }
+
+  while(now < deadline)
+    now = getTimeNs();
+}
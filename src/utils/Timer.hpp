@@ -0,0 +1,27 @@
+/**
+* @file Timer.hpp
+* @author Dmitri Koudriavtsev
+* @brief Defenition of high resolution timer helpers.
+*/
+
+#ifndef TIMER_HPP_INCLUDED
+#define TIMER_HPP_INCLUDED
+
+#include <SDL/SDL.h>
+
+/** @return Time of monotonic clock in nanoseconds, not related to wall time. */
+Uint64 getTimeNs();
+
+/** Sleep until monotonic clock reaches deadline. Most of the time is
+* slept, last millisecond is spun, so wake up is not late by scheduler tick.
+* @param deadline Time of getTimeNs to wake up at.
+*/
+void sleepUntilNs(Uint64 deadline);
+
+/** @return Nanoseconds converted to milliseconds. */
+inline double nsToMs(Uint64 ns)
+{
+  return static_cast<double>(ns) / 1000000.0;
+}
+
+#endif // TIMER_HPP_INCLUDED